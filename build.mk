@@ -10,7 +10,7 @@ INCLUDES += -iquote $(src)/sys
 INCLUDES += -iquote $(src)/ext/lwip/include/ipv4/
 
 CPPFLAGS = -U ebbrt -MD -MT $@ -MP $(optflags) -Wall -Werror \
-	-fno-stack-protector $(INCLUDES)
+	-fno-stack-protector -fno-omit-frame-pointer $(INCLUDES)
 CXXFLAGS = -std=gnu++11
 CFLAGS = -std=gnu99
 ASFLAGS = -MD -MT $@ -MP $(optflags) -DASSEMBLY
@@ -40,15 +40,19 @@ q-build-s = $(call quiet, $(build-s), AS $@)
 
 objects = sys/acpi.o
 objects += sys/apic.o
+objects += sys/arena.o
 objects += sys/boot.o
 objects += sys/clock.o
 objects += sys/cpu.o
 objects += sys/cpuid.o
 objects += sys/debug.o
+objects += sys/demand_paged_region.o
+objects += sys/dma_pool.o
 objects += sys/e820.o
 objects += sys/early_page_allocator.o
 objects += sys/ebb_allocator.o
 objects += sys/event_manager.o
+objects += sys/heap_profiler.o
 objects += sys/idt.o
 objects += sys/isr.o
 objects += sys/local_id_map.o
@@ -63,6 +67,7 @@ objects += sys/slab_allocator.o
 objects += sys/smp.o
 objects += sys/stack.o
 objects += sys/timer.o
+objects += sys/tlb.o
 objects += sys/tls.o
 objects += sys/trans.o
 objects += sys/UART_8250.o
@@ -0,0 +1,74 @@
+#include <array>
+
+#include <sys/arena.hpp>
+#include <sys/cache_aligned.hpp>
+#include <sys/cpu.hpp>
+#include <sys/event_manager.hpp>
+#include <sys/page_allocator.hpp>
+
+using namespace ebbrt;
+
+namespace {
+// Released CHUNK_ORDER chunks are kept per core so the common
+// allocate/release cycle of an event doesn't touch the page allocator's lock
+const constexpr size_t CHUNK_CACHE_SIZE = 32;
+
+struct chunk_cache : cache_aligned {
+  pfn_t chunks[CHUNK_CACHE_SIZE];
+  size_t size;
+};
+
+std::array<chunk_cache, MAX_NUM_CPUS> chunk_caches;
+
+pfn_t alloc_chunk(size_t order) {
+  auto &cache = chunk_caches[my_cpu()];
+  if (order == arena::CHUNK_ORDER && cache.size > 0)
+    return cache.chunks[--cache.size];
+  return page_allocator->Alloc(order);
+}
+
+void free_chunk(pfn_t pfn, size_t order) {
+  auto &cache = chunk_caches[my_cpu()];
+  if (order == arena::CHUNK_ORDER && cache.size < CHUNK_CACHE_SIZE) {
+    cache.chunks[cache.size++] = pfn;
+    return;
+  }
+  page_allocator->Free(pfn, order);
+}
+}
+
+void *arena::alloc_slow(size_t size, size_t align) {
+  // oversized requests get a chunk of their own
+  auto order = CHUNK_ORDER;
+  while ((PAGE_SIZE << order) < sizeof(chunk) + align + size) {
+    ++order;
+    if (order > PageAllocator::MAX_ORDER)
+      throw std::bad_alloc();
+  }
+
+  auto pfn = alloc_chunk(order);
+  if (pfn == NO_PFN)
+    throw std::bad_alloc();
+
+  auto c = reinterpret_cast<chunk *>(pfn_to_addr(pfn));
+  c->next = chunks_;
+  c->order = order;
+  chunks_ = c;
+
+  auto p = align_up(reinterpret_cast<uintptr_t>(c + 1), align);
+  cur_ = p + size;
+  end_ = pfn_to_addr(pfn) + (PAGE_SIZE << order);
+  return reinterpret_cast<void *>(p);
+}
+
+void arena::release() {
+  while (chunks_ != nullptr) {
+    auto c = chunks_;
+    chunks_ = c->next;
+    free_chunk(pfn_down(c), c->order);
+  }
+  cur_ = 0;
+  end_ = 0;
+}
+
+arena &ebbrt::event_arena() { return event_manager->CurrentArena(); }
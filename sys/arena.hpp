@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+#include <sys/align.hpp>
+#include <sys/pfn.hpp>
+
+namespace ebbrt {
+// Bump allocator for memory that dies together. Nothing is freed
+// individually, release (or destruction) hands every chunk back at once.
+// Chunks come from a per-core cache in front of the page allocator, so an
+// arena must be used from one core at a time.
+class arena {
+  struct chunk {
+    chunk *next;
+    size_t order;
+  };
+
+  chunk *chunks_;
+  uintptr_t cur_;
+  uintptr_t end_;
+
+  void *alloc_slow(size_t size, size_t align);
+
+public:
+  static const constexpr size_t CHUNK_ORDER = 2;
+  static const constexpr size_t DEFAULT_ALIGN = 16;
+
+  arena() : chunks_{ nullptr }, cur_{ 0 }, end_{ 0 } {}
+  ~arena() { release(); }
+
+  arena(const arena &) = delete;
+  arena &operator=(const arena &) = delete;
+
+  void *alloc(size_t size, size_t align = DEFAULT_ALIGN) {
+    auto p = align_up(cur_, align);
+    if (p <= end_ && size <= end_ - p) {
+      cur_ = p + size;
+      return reinterpret_cast<void *>(p);
+    }
+    return alloc_slow(size, align);
+  }
+
+  void release();
+};
+
+// The arena of the event running on this core, released when the event
+// returns. An event which saves its context keeps its arena until it is
+// reactivated and returns.
+arena &event_arena();
+
+template <typename T> class arena_allocator {
+  arena *arena_;
+
+  template <typename U> friend class arena_allocator;
+
+public:
+  typedef T value_type;
+  typedef T *pointer;
+  typedef const T *const_pointer;
+  typedef T &reference;
+  typedef const T &const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <typename U> struct rebind {
+    typedef arena_allocator<U> other;
+  };
+
+  arena_allocator() : arena_{ &event_arena() } {}
+  explicit arena_allocator(arena &a) : arena_{ &a } {}
+  template <typename U>
+  arena_allocator(const arena_allocator<U> &other)
+      : arena_{ other.arena_ } {}
+
+  pointer allocate(size_type n, const void * = nullptr) {
+    if (n > max_size())
+      throw std::bad_alloc();
+    return static_cast<pointer>(arena_->alloc(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(pointer p, size_type n) {}
+
+  size_type max_size() const { return size_t(-1) / sizeof(T); }
+
+  template <typename U, typename... Args>
+  void construct(U *p, Args &&... args) {
+    ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+  }
+
+  template <typename U> void destroy(U *p) { p->~U(); }
+
+  template <typename U> bool operator==(const arena_allocator<U> &other) const {
+    return arena_ == other.arena_;
+  }
+
+  template <typename U> bool operator!=(const arena_allocator<U> &other) const {
+    return arena_ != other.arena_;
+  }
+};
+}
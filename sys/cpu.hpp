@@ -1,5 +1,7 @@
 #pragma once
 
+#include <bitset>
+
 #include <boost/container/static_vector.hpp>
 
 #include <sys/apic.hpp>
@@ -168,6 +170,8 @@ public:
 
 const constexpr size_t MAX_NUM_CPUS = 256;
 
+typedef std::bitset<MAX_NUM_CPUS> cpumask;
+
 inline cpu &my_cpu() { return *my_cpu_tls; }
 
 extern boost::container::static_vector<cpu, MAX_NUM_CPUS> cpus;
@@ -0,0 +1,92 @@
+#include <algorithm>
+
+#include <sys/align.hpp>
+#include <sys/debug.hpp>
+#include <sys/demand_paged_region.hpp>
+#include <sys/page_allocator.hpp>
+#include <sys/vmem.hpp>
+
+using namespace ebbrt;
+
+demand_paged_region::demand_paged_region(size_t guard_pages,
+                                         size_t initial_window,
+                                         size_t max_window)
+    : npages_{ 0 }, guard_pages_{ guard_pages },
+      initial_window_{ std::max(initial_window, size_t(1)) },
+      max_window_{ std::max(max_window, initial_window_) },
+      window_{ initial_window_ }, last_begin_{ 0 }, last_end_{ 0 } {
+  // a random fault fills the window aligned block around it
+  kassert((initial_window_ & (initial_window_ - 1)) == 0);
+}
+
+demand_paged_region::~demand_paged_region() {
+  for (size_t i = 0; i < npages_; ++i) {
+    if (backing_[i] != NO_PFN)
+      page_allocator->Free(backing_[i]);
+  }
+}
+
+void demand_paged_region::set_region(pfn_t start, size_t npages) {
+  kbugon(guard_pages_ >= npages, "Demand paged region is all guard pages\n");
+  start_ = start;
+  npages_ = npages;
+  backing_.reset(new pfn_t[npages]);
+  std::fill(backing_.get(), backing_.get() + npages, NO_PFN);
+}
+
+// Make sure page idx is backed and mapped on this core, returns false if no
+// backing page could be allocated
+bool demand_paged_region::back_page(size_t idx) {
+  auto vfn = start_ + idx;
+  auto &backing = backing_[idx];
+  if (backing == NO_PFN) {
+    auto page = page_allocator->Alloc();
+    if (page == NO_PFN)
+      return false;
+    backing = page;
+  } else if (is_mapped(vfn)) {
+    // another core mapped it in a page table we share
+    return true;
+  }
+  map_memory(vfn, backing);
+  return true;
+}
+
+void demand_paged_region::handle_fault(exception_frame *ef,
+                                       uintptr_t faulted_address) {
+  std::lock_guard<spinlock> lock{ lock_ };
+  kassert(npages_ != 0);
+  size_t idx = pfn_down(faulted_address) - start_;
+  kbugon(idx >= npages_, "Fault outside of demand paged region\n");
+  kbugon(idx < guard_pages_, "Fault on guard page of demand paged region "
+                             "(stack overflow?)\n");
+
+  size_t begin, end;
+  if (idx == last_end_) {
+    // sequential, ascending
+    window_ = std::min(window_ * 2, max_window_);
+    begin = idx;
+    end = idx + window_;
+  } else if (idx + 1 == last_begin_) {
+    // sequential, descending
+    window_ = std::min(window_ * 2, max_window_);
+    begin = idx + 1 > window_ ? idx + 1 - window_ : 0;
+    end = idx + 1;
+  } else {
+    window_ = initial_window_;
+    begin = align_down(idx, window_);
+    end = begin + window_;
+  }
+  begin = std::max(begin, guard_pages_);
+  end = std::min(end, npages_);
+
+  kbugon(!back_page(idx), "Failed to allocate page for demand paged region\n");
+  // map the rest of the window on a best effort basis
+  for (auto i = begin; i < end; ++i) {
+    if (i != idx && !back_page(i))
+      break;
+  }
+
+  last_begin_ = begin;
+  last_end_ = end;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <memory>
+
+#include <sys/pfn.hpp>
+#include <sys/spinlock.hpp>
+#include <sys/vmem_allocator.hpp>
+
+namespace ebbrt {
+// A page fault handler that backs a region with pages from the page allocator
+// on demand. Each fault maps a window of neighbouring pages; the window grows
+// while faults walk sequentially through the region (in either direction) and
+// falls back to the initial size on a random access.
+class demand_paged_region : public VMemAllocator::page_fault_handler_t {
+  spinlock lock_;
+  pfn_t start_;
+  size_t npages_;
+  size_t guard_pages_;
+  size_t initial_window_;
+  size_t max_window_;
+  size_t window_;
+  // pages mapped by the previous fault, [last_begin_, last_end_)
+  size_t last_begin_;
+  size_t last_end_;
+  // backing page for each page of the region, NO_PFN until first touched
+  std::unique_ptr<pfn_t[]> backing_;
+
+  bool back_page(size_t idx);
+
+public:
+  static const constexpr size_t DEFAULT_INITIAL_WINDOW = 4;
+  static const constexpr size_t DEFAULT_MAX_WINDOW = 64;
+
+  // The lowest guard_pages pages of the region are never backed, a fault on
+  // one of them aborts (e.g. stack overflow). initial_window must be a power
+  // of two.
+  explicit demand_paged_region(size_t guard_pages = 0,
+                               size_t initial_window = DEFAULT_INITIAL_WINDOW,
+                               size_t max_window = DEFAULT_MAX_WINDOW);
+  demand_paged_region(const demand_paged_region &) = delete;
+  demand_paged_region &operator=(const demand_paged_region &) = delete;
+  ~demand_paged_region();
+
+  void set_region(pfn_t start, size_t npages) override;
+  void handle_fault(exception_frame *ef, uintptr_t faulted_address) override;
+};
+}
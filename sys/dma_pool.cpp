@@ -0,0 +1,38 @@
+#include <sys/dma_pool.hpp>
+#include <sys/fls.hpp>
+#include <sys/page_allocator.hpp>
+
+using namespace ebbrt;
+
+namespace {
+size_t dma_order(size_t size) {
+  if (size <= PAGE_SIZE)
+    return 0;
+  return fls(size - 1) - PAGE_SHIFT + 1;
+}
+}
+
+dma_buffer ebbrt::dma_alloc_coherent(size_t size, nid_t nid) {
+  auto order = dma_order(size);
+  kbugon(order > PageAllocator::MAX_ORDER,
+         "%s: %llu bytes is too large\n", __PRETTY_FUNCTION__, size);
+  auto page = page_allocator->AllocZeroed(order, nid);
+  kbugon(page == NO_PFN, "%s: page allocation failed\n", __PRETTY_FUNCTION__);
+  auto addr = reinterpret_cast<void *>(pfn_to_addr(page));
+  return dma_buffer{ addr, dma_addr(addr), size };
+}
+
+void ebbrt::dma_free_coherent(const dma_buffer &buf) {
+  page_allocator->Free(pfn_down(buf.addr), dma_order(buf.size));
+}
+
+dma_pool::dma_pool(size_t size, size_t align)
+    : root_{ new SlabAllocatorRoot(size, align) } {}
+
+dma_pool::~dma_pool() { delete root_; }
+
+void *dma_pool::alloc(nid_t nid) {
+  return root_->get_cpu_allocator().Alloc(nid);
+}
+
+void dma_pool::free(void *addr) { root_->get_cpu_allocator().Free(addr); }
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+
+#include <sys/cache_aligned.hpp>
+#include <sys/debug.hpp>
+#include <sys/numa.hpp>
+#include <sys/pfn.hpp>
+#include <sys/slab_allocator.hpp>
+
+namespace ebbrt {
+// Physical memory is identity mapped, so memory from the page and slab
+// allocators has a bus address equal to its virtual address. Memory in the
+// VMemAllocator's range (above 0xFFFF800000000000) does not and must never be
+// handed to a device.
+const constexpr uintptr_t DMA_ADDR_LIMIT = 0xFFFF800000000000;
+
+inline uint64_t dma_addr(const void *addr) {
+  auto val = reinterpret_cast<uintptr_t>(addr);
+  kassert(val < DMA_ADDR_LIMIT);
+  return val;
+}
+
+inline void *dma_to_virt(uint64_t addr) {
+  kassert(addr < DMA_ADDR_LIMIT);
+  return reinterpret_cast<void *>(addr);
+}
+
+struct dma_buffer {
+  void *addr;
+  uint64_t dma_addr;
+  size_t size;
+};
+
+// Physically contiguous, zeroed memory for long lived device structures such
+// as rings
+dma_buffer dma_alloc_coherent(size_t size, nid_t nid = my_node());
+void dma_free_coherent(const dma_buffer &buf);
+
+// Fixed size device buffers. Each buffer lies within a single physically
+// contiguous slab, comes from the requested node and is cached per core.
+// Buffers may also be released with free(), which finds the owning slab.
+class dma_pool {
+  SlabAllocatorRoot *root_;
+
+public:
+  explicit dma_pool(size_t size, size_t align = cache_size);
+  dma_pool(const dma_pool &) = delete;
+  dma_pool &operator=(const dma_pool &) = delete;
+  ~dma_pool();
+
+  // returns nullptr if the node is out of memory
+  void *alloc(nid_t nid = my_node());
+  void free(void *addr);
+  size_t buffer_size() const { return root_->size; }
+};
+}
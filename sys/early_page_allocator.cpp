@@ -1,6 +1,8 @@
 #include <cinttypes>
+#include <cstring>
 #include <new>
 
+#include <boost/container/static_vector.hpp>
 #include <boost/utility.hpp>
 
 #include <sys/align.hpp>
@@ -13,6 +15,8 @@ explicitly_constructed<free_pages_tree> ebbrt::free_pages;
 void ebbrt::early_page_allocator_init() { free_pages.construct(); }
 
 namespace {
+boost::container::static_vector<reserved_pages, MAX_RESERVATIONS> reservations;
+
 typedef decltype(free_pages->begin()) free_page_iterator;
 free_page_iterator coalesce(free_page_iterator a, free_page_iterator b) {
   if (a->end() != b->start())
@@ -113,3 +117,53 @@ void ebbrt::early_set_nid_range(pfn_t start, pfn_t end, nid_t nid) {
     it->nid = nid;
   }
 }
+
+pfn_t ebbrt::early_reserve_pages(const char *name, size_t npages, nid_t nid,
+                                 size_t align) {
+  kbugon(reservations.size() == reservations.capacity(),
+         "Too many memory reservations\n");
+  for (auto it = free_pages->begin(); it != free_pages->end(); ++it) {
+    if (nid != ANY_NID && it->nid != nid)
+      continue;
+
+    if (it->npages < npages)
+      continue;
+
+    // take from the top of the range like early_allocate_page, what is left
+    // above the aligned start stays free
+    auto ret = pfn_t(align_down(uintptr_t(it->end() - npages), align));
+    if (ret < it->start())
+      continue;
+
+    auto range_nid = it->nid;
+    auto tail_start = ret + npages;
+    auto tail_end = it->end();
+    if (ret == it->start()) {
+      free_pages->erase(it);
+    } else {
+      it->npages = ret - it->start();
+    }
+    // the iterator is potentially no longer valid, don't use it
+
+    if (tail_start != tail_end)
+      free_page_range(tail_start, tail_end, range_nid);
+
+    reservations.push_back(reserved_pages{ name, ret, npages, range_nid });
+    kprintf("Reserved %s: %#018" PRIx64 "-%#018" PRIx64 " -> %u\n", name,
+            pfn_to_addr(ret), pfn_to_addr(ret + npages) - 1,
+            (unsigned)range_nid);
+    return ret;
+  }
+
+  return NO_PFN;
+}
+
+const reserved_pages *ebbrt::find_reserved_pages(const char *name,
+                                                 nid_t nid) {
+  for (const auto &reservation : reservations) {
+    if ((nid == ANY_NID || reservation.nid == nid) &&
+        std::strcmp(reservation.name, name) == 0)
+      return &reservation;
+  }
+  return nullptr;
+}
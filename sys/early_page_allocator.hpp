@@ -14,6 +14,24 @@ pfn_t early_allocate_page(unsigned int npages = 1, nid_t nid = ANY_NID);
 void early_free_page(pfn_t start, pfn_t end, nid_t nid = ANY_NID);
 void early_set_nid_range(pfn_t start, pfn_t end, nid_t nid);
 
+// Boot time reservations of large physically contiguous pools, taken before
+// the buddy allocator gets the memory and fragments it. Reservations must be
+// made after numa_init and before PageAllocator::Init and are never freed.
+struct reserved_pages {
+  const char *name;
+  pfn_t start;
+  size_t npages;
+  nid_t nid;
+};
+
+const constexpr size_t MAX_RESERVATIONS = 32;
+
+// returns NO_PFN if no free range on the node is large enough
+pfn_t early_reserve_pages(const char *name, size_t npages, nid_t nid = ANY_NID,
+                          size_t align = 1);
+const reserved_pages *find_reserved_pages(const char *name,
+                                          nid_t nid = ANY_NID);
+
 struct page_range {
   inline explicit page_range(size_t npages, nid_t nid) noexcept
       : npages{ npages },
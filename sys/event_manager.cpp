@@ -1,11 +1,13 @@
-#include <unordered_map>
-
 #include <boost/container/flat_map.hpp>
 
+#include <sys/apic.hpp>
+#include <sys/cache_aligned.hpp>
 #include <sys/cpu.hpp>
+#include <sys/demand_paged_region.hpp>
 #include <sys/event_manager.hpp>
 #include <sys/local_id_map.hpp>
 #include <sys/page_allocator.hpp>
+#include <sys/spinlock.hpp>
 #include <sys/vmem.hpp>
 
 using namespace ebbrt;
@@ -42,34 +44,15 @@ EventManager& EventManager::HandleFault(EbbId id) {
 
 namespace {
 const constexpr size_t STACK_NPAGES = 2048;  // 8 MB stack
-}
 
-class event_stack_fault_handler : public VMemAllocator::page_fault_handler_t {
-  std::unordered_map<pfn_t, pfn_t> mappings_;
-
- public:
-  event_stack_fault_handler() = default;
-  event_stack_fault_handler(const event_stack_fault_handler&) = delete;
-  event_stack_fault_handler& operator=(const event_stack_fault_handler&) =
-      delete;
-  ~event_stack_fault_handler() {
-    kbugon(!mappings_.empty(), "Free stack pages!\n");
-  }
-  void handle_fault(exception_frame* ef, uintptr_t faulted_address) override {
-    auto page = pfn_down(faulted_address);
-    auto it = mappings_.find(page);
-    if (it == mappings_.end()) {
-      kbugon(mappings_.size() + 1 >= STACK_NPAGES, "Stack overflow!\n");
-      auto backing_page = page_allocator->Alloc();
-      kbugon(backing_page == 0, "Failed to allocate page for stack\n");
-      map_memory(page, backing_page);
-      mappings_[page] = backing_page;
-    } else {
-      map_memory(page, it->second);
-    }
-  }
+struct remote_queue : cache_aligned {
+  spinlock lock;
+  std::vector<std::function<void()> > tasks;
 };
 
+std::array<remote_queue, MAX_NUM_CPUS> remote_queues;
+}
+
 extern "C" __attribute__((noreturn)) void switch_stack(uintptr_t first_param,
                                                        uintptr_t stack,
                                                        void (*func)(uintptr_t));
@@ -112,15 +95,24 @@ process:
   //interrupt does not return here but instead to the top of this function)
 
   if (!tasks_.empty()) {
-    auto f = std::move(tasks_.top());
-    tasks_.pop();
-    invoke_function(f);
+    {
+      auto f = std::move(tasks_.top());
+      tasks_.pop();
+      invoke_function(f);
+    }
+    // anything the task captured is gone, so is its arena
+    arena_->release();
     //if we had a task to execute, then we go to the top again
     goto process;
   }
 
-  //We only reach here if we had no interrupts to process or tasks to run. We
-  //halt until an interrupt wakes us
+  //Nothing urgent, give background work a turn then check for interrupts
+  //again before doing more
+  if (RunIdleHandler())
+    goto process;
+
+  //We only reach here if we had no interrupts to process, tasks to run or
+  //idle work to do. We halt until an interrupt wakes us
   asm volatile("sti;"
                "hlt;");
   kabort("Woke up from halt?!?!");
@@ -132,17 +124,48 @@ pfn_t EventManager::AllocateStack() {
     free_stacks_.pop();
     return ret;
   }
-  auto fault_handler = new event_stack_fault_handler;
+  // the lowest page is left unbacked to catch stack overflow
+  auto fault_handler = new demand_paged_region(1);
   return vmem_allocator->Alloc(
-      STACK_NPAGES, std::unique_ptr<event_stack_fault_handler>(fault_handler));
+      STACK_NPAGES, std::unique_ptr<demand_paged_region>(fault_handler));
 }
 
-EventManager::EventManager() : vector_idx_(32) { stack_ = AllocateStack(); }
+EventManager::EventManager()
+    : vector_idx_(FIRST_FREE_VECTOR), next_idle_handler_(0) {
+  stack_ = AllocateStack();
+  arena_ = new arena;
+  vector_map_[SPAWN_REMOTE_VECTOR] = [this]() {
+    std::vector<std::function<void()> > tasks;
+    {
+      auto& queue = remote_queues[my_cpu()];
+      std::lock_guard<spinlock> lock{ queue.lock };
+      tasks.swap(queue.tasks);
+    }
+    for (auto& task : tasks) {
+      SpawnLocal(std::move(task));
+    }
+  };
+}
 
 void EventManager::SpawnLocal(std::function<void()> func) {
   tasks_.emplace(std::move(func));
 }
 
+void EventManager::SpawnRemote(std::function<void()> func, size_t cpu) {
+  if (cpu == my_cpu()) {
+    SpawnLocal(std::move(func));
+    return;
+  }
+
+  kassert(cpu < cpus.size());
+  {
+    auto& queue = remote_queues[cpu];
+    std::lock_guard<spinlock> lock{ queue.lock };
+    queue.tasks.emplace_back(std::move(func));
+  }
+  apic_ipi(cpus[cpu].get_apic_id(), SPAWN_REMOTE_VECTOR);
+}
+
 extern "C" void save_context_and_switch(uintptr_t first_param,
                                         uintptr_t stack,
                                         void (*func)(uintptr_t),
@@ -151,6 +174,9 @@ extern "C" void save_context_and_switch(uintptr_t first_param,
 void EventManager::SaveContext(EventContext& context) {
   context.stack = stack_;
   stack_ = AllocateStack();
+  // the saved event may still be using its arena, carry on with a new one
+  context.event_arena = arena_;
+  arena_ = new arena;
   auto stack_top = pfn_to_addr(stack_ + STACK_NPAGES);
   my_cpu().set_event_stack(stack_top);
   save_context_and_switch(
@@ -164,6 +190,8 @@ void EventManager::ActivateContext(const EventContext& context) {
   SpawnLocal([this, context]() {
     free_stacks_.push(stack_);
     stack_ = context.stack;
+    delete arena_;
+    arena_ = context.event_arena;
     auto stack_top = pfn_to_addr(context.stack + STACK_NPAGES);
     my_cpu().set_event_stack(stack_top);
     activate_context_and_return(context);
@@ -176,12 +204,44 @@ uint8_t EventManager::AllocateVector(std::function<void()> func) {
   return vec;
 }
 
+void EventManager::InstallVector(uint8_t vec, std::function<void()> func) {
+  kassert(vec < FIRST_FREE_VECTOR);
+  vector_map_[vec] = std::move(func);
+}
+
+void EventManager::AddIdleHandler(std::function<bool()> func) {
+  idle_handlers_.emplace_back(std::move(func));
+}
+
+bool EventManager::RunIdleHandler() {
+  // round robin so one busy handler can't starve the rest
+  for (size_t i = 0; i < idle_handlers_.size(); ++i) {
+    auto idx = next_idle_handler_;
+    next_idle_handler_ = (next_idle_handler_ + 1) % idle_handlers_.size();
+    auto& f = idle_handlers_[idx];
+    bool ret;
+    try {
+      ret = f();
+    }
+    catch (std::exception & e) {
+      kabort("Unhandled exception caught: %s\n", e.what());
+    }
+    catch (...) {
+      kabort("Unhandled exception caught!\n");
+    }
+    if (ret)
+      return true;
+  }
+  return false;
+}
+
 void EventManager::ProcessInterrupt(int num) {
   apic_eoi();
   auto it = vector_map_.find(num);
   if (it != vector_map_.end()) {
     auto& f = it->second;
     invoke_function(f);
+    arena_->release();
   }
   Process();
 }
@@ -2,7 +2,9 @@
 
 #include <stack>
 #include <unordered_map>
+#include <vector>
 
+#include <sys/arena.hpp>
 #include <sys/main.hpp>
 #include <sys/smp.hpp>
 #include <sys/trans.hpp>
@@ -12,6 +14,12 @@ namespace ebbrt {
 
 extern "C" void event_interrupt(int num);
 
+// Vectors below FIRST_FREE_VECTOR are installed on every core with
+// InstallVector, AllocateVector hands out the rest
+const constexpr uint8_t TLB_SHOOTDOWN_VECTOR = 32;
+const constexpr uint8_t SPAWN_REMOTE_VECTOR = 33;
+const constexpr uint8_t FIRST_FREE_VECTOR = 34;
+
 class EventManager {
   friend void ebbrt::kmain(ebbrt::MultibootInformation* mbi);
   friend void ebbrt::smp_main();
@@ -24,10 +32,15 @@ class EventManager {
   pfn_t AllocateStack();
 
   pfn_t stack_;
+  arena *arena_;
   std::stack<pfn_t> free_stacks_;
   std::stack<std::function<void()> > tasks_;
   std::unordered_map<uint8_t, std::function<void()> > vector_map_;
   std::atomic<uint8_t> vector_idx_;
+  std::vector<std::function<bool()> > idle_handlers_;
+  size_t next_idle_handler_;
+
+  bool RunIdleHandler();
 
  public:
   static void Init();
@@ -36,6 +49,9 @@ class EventManager {
   EventManager();
 
   void SpawnLocal(std::function<void()> func);
+  // Run func as an event on another core. It is handed over with an IPI, so
+  // this suits setup work rather than anything frequent.
+  void SpawnRemote(std::function<void()> func, size_t cpu);
   struct EventContext {
     uint64_t rbx;
     uint64_t rsp;
@@ -45,10 +61,17 @@ class EventManager {
     uint64_t r14;
     uint64_t r15;
     pfn_t stack;
+    arena *event_arena;
   };
   void SaveContext(EventContext& context);
   void ActivateContext(const EventContext& context);
   uint8_t AllocateVector(std::function<void()> func);
+  void InstallVector(uint8_t vec, std::function<void()> func);
+  // Idle handlers run only when this core has no events or interrupts
+  // pending. Each call should do a small bounded amount of background work
+  // and return false once there is nothing left to do, letting the core halt.
+  void AddIdleHandler(std::function<bool()> func);
+  arena &CurrentArena() { return *arena_; }
 };
 
 constexpr auto event_manager = EbbRef<EventManager>(event_manager_id);
@@ -1,16 +1,43 @@
 #pragma once
 
 #include <array>
+#include <atomic>
+#include <chrono>
 
 #include <sys/cache_aligned.hpp>
 #include <sys/debug.hpp>
 #include <sys/slab_allocator.hpp>
+#include <sys/timer.hpp>
 #include <sys/trans.hpp>
 
 namespace ebbrt {
+// Requests up to GP_HISTOGRAM_MAX_SIZE are counted per core in buckets of
+// GP_HISTOGRAM_GRANULE bytes. In adaptive mode the histogram is folded
+// periodically. A size that accounts for GP_ADAPTIVE_POPULAR_PERCENT of recent
+// requests and wastes more than GP_ADAPTIVE_WASTE_PERCENT of its class gets a
+// class of its own. The granule is malloc's alignment, which adaptive classes
+// keep.
+const constexpr size_t GP_HISTOGRAM_GRANULE = 16;
+const constexpr size_t GP_HISTOGRAM_MAX_SIZE = 4096;
+const constexpr size_t GP_HISTOGRAM_BUCKETS =
+    GP_HISTOGRAM_MAX_SIZE / GP_HISTOGRAM_GRANULE + 1;
+const constexpr size_t GP_ADAPTIVE_POPULAR_PERCENT = 1;
+const constexpr size_t GP_ADAPTIVE_WASTE_PERCENT = 25;
+const constexpr uint64_t GP_ADAPTIVE_MIN_COUNT = 1024;
+const constexpr size_t GP_MAX_ADAPTIVE_CLASSES = 32;
+
 template <size_t... sizes_in>
 class general_purpose_allocator : public cache_aligned {
   std::array<SlabAllocator *, sizeof...(sizes_in)> allocators_;
+  std::array<std::atomic<uint64_t>, GP_HISTOGRAM_BUCKETS> histogram_;
+
+  // Classes created at runtime, indexed by histogram bucket. A bucket with
+  // no entry uses the static classes.
+  static std::array<std::atomic<SlabAllocatorRoot *>, GP_HISTOGRAM_BUCKETS>
+  adaptive_roots;
+  static size_t num_adaptive_classes;
+  // histogram totals at the last Adapt
+  static std::array<uint64_t, GP_HISTOGRAM_BUCKETS> adapted_counts;
 
   static std::array<SlabAllocatorRoot *, sizeof...(sizes_in)> allocator_roots;
 
@@ -53,6 +80,14 @@ class general_purpose_allocator : public cache_aligned {
     }
   };
 
+  static size_t class_size(size_t bucket) {
+    auto root = adaptive_roots[bucket].load(std::memory_order_relaxed);
+    if (root != nullptr)
+      return root->size;
+    indexer<0, sizes_in...> i;
+    return allocator_roots[i(bucket * GP_HISTOGRAM_GRANULE)]->size;
+  }
+
 public:
   static void Init() {
     rep_allocator =
@@ -73,10 +108,92 @@ public:
     return allocator;
   }
 
+  // Fold every core's histogram since the last call and create classes for
+  // popular wasteful sizes. Only one core may run this, StartAdaptive sets up
+  // a timer on the calling core.
+  static void Adapt() {
+    std::array<uint64_t, GP_HISTOGRAM_BUCKETS> counts;
+    counts.fill(0);
+    for (auto rep : reps) {
+      if (rep == nullptr)
+        continue;
+      for (size_t b = 0; b < GP_HISTOGRAM_BUCKETS; ++b)
+        counts[b] += rep->histogram_[b].load(std::memory_order_relaxed);
+    }
+
+    uint64_t total = 0;
+    for (size_t b = 0; b < GP_HISTOGRAM_BUCKETS; ++b) {
+      auto recent = counts[b] - adapted_counts[b];
+      adapted_counts[b] = counts[b];
+      counts[b] = recent;
+      total += recent;
+    }
+
+    for (size_t b = 1; b < GP_HISTOGRAM_BUCKETS; ++b) {
+      if (num_adaptive_classes == GP_MAX_ADAPTIVE_CLASSES)
+        return;
+      if (counts[b] < GP_ADAPTIVE_MIN_COUNT ||
+          counts[b] * 100 < total * GP_ADAPTIVE_POPULAR_PERCENT)
+        continue;
+      auto size = b * GP_HISTOGRAM_GRANULE;
+      auto current = class_size(b);
+      if ((current - size) * 100 <= current * GP_ADAPTIVE_WASTE_PERCENT)
+        continue;
+
+      auto root = new SlabAllocatorRoot(size, GP_HISTOGRAM_GRANULE);
+      // smaller buckets move over too unless they already have a class that
+      // is at least as tight
+      for (auto i = b; i > 0 && class_size(i) > size; --i)
+        adaptive_roots[i].store(root, std::memory_order_release);
+      ++num_adaptive_classes;
+      kprintf("gp allocator: added %zu byte class (was %zu)\n", size, current);
+    }
+  }
+
+  static void StartAdaptive(std::chrono::microseconds interval) {
+    timer->Start(interval, Adapt);
+  }
+
+  static void PrintHistogram() {
+    for (size_t b = 1; b < GP_HISTOGRAM_BUCKETS; ++b) {
+      uint64_t count = 0;
+      for (auto rep : reps) {
+        if (rep != nullptr)
+          count += rep->histogram_[b].load(std::memory_order_relaxed);
+      }
+      if (count != 0)
+        kprintf("gp %zu bytes: %llu allocations, %zu byte class\n",
+                b * GP_HISTOGRAM_GRANULE, (unsigned long long)count,
+                class_size(b));
+    }
+  }
+
   general_purpose_allocator() {
     for (size_t i = 0; i < allocators_.size(); ++i) {
       allocators_[i] = &allocator_roots[i]->get_cpu_allocator();
     }
+    for (auto &count : histogram_)
+      count.store(0, std::memory_order_relaxed);
+  }
+
+  static void PrintStats() {
+    for (auto root : allocator_roots) {
+      auto stats = root->stats();
+      kprintf("gp %zu bytes: %zu in use, %zu cached, %zu slabs\n", root->size,
+              stats.objects_in_use, stats.cached_objects, stats.slabs);
+    }
+    // an adaptive class covers a run of neighbouring buckets
+    SlabAllocatorRoot *prev = nullptr;
+    for (auto &entry : adaptive_roots) {
+      auto root = entry.load(std::memory_order_acquire);
+      if (root != nullptr && root != prev) {
+        auto stats = root->stats();
+        kprintf("gp %zu bytes (adaptive): %zu in use, %zu cached, %zu slabs\n",
+                root->size, stats.objects_in_use, stats.cached_objects,
+                stats.slabs);
+      }
+      prev = root;
+    }
   }
 
   void *operator new(size_t size) {
@@ -92,6 +209,22 @@ public:
   void operator delete(void *p) { UNIMPLEMENTED(); }
 
   void *Alloc(size_t size, nid_t nid = my_node()) {
+    if (size <= GP_HISTOGRAM_MAX_SIZE) {
+      auto bucket = (size + GP_HISTOGRAM_GRANULE - 1) / GP_HISTOGRAM_GRANULE;
+      // only this core writes its histogram
+      auto &count = histogram_[bucket];
+      count.store(count.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+
+      auto root = adaptive_roots[bucket].load(std::memory_order_acquire);
+      if (root != nullptr) {
+        auto ret = root->get_cpu_allocator().Alloc(nid);
+        kbugon(ret == nullptr,
+               "Failed to allocate from this NUMA node, should try others\n");
+        return ret;
+      }
+    }
+
     indexer<0, sizes_in...> i;
     auto index = i(size);
     kbugon(index == -1, "Attempt to allocate %zu bytes not supported\n", size);
@@ -121,6 +254,17 @@ general_purpose_allocator<sizes_in...>::reps;
 template <size_t... sizes_in>
 SlabAllocatorRoot *general_purpose_allocator<sizes_in...>::rep_allocator;
 
+template <size_t... sizes_in>
+std::array<std::atomic<SlabAllocatorRoot *>, GP_HISTOGRAM_BUCKETS>
+general_purpose_allocator<sizes_in...>::adaptive_roots;
+
+template <size_t... sizes_in>
+size_t general_purpose_allocator<sizes_in...>::num_adaptive_classes;
+
+template <size_t... sizes_in>
+std::array<uint64_t, GP_HISTOGRAM_BUCKETS>
+general_purpose_allocator<sizes_in...>::adapted_counts;
+
 // roughly equivalent to the breakdown Linux uses, may need tuning
 typedef general_purpose_allocator<
     8, 16, 32, 64, 96, 128, 192, 256, 512, 1024, 2 * 1024, 4 * 1024, 8 * 1024,
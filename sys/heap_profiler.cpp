@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <mutex>
+
+#include <sys/clock.hpp>
+#include <sys/debug.hpp>
+#include <sys/event_manager.hpp>
+#include <sys/heap_profiler.hpp>
+#include <sys/page_allocator.hpp>
+#include <sys/spinlock.hpp>
+
+using namespace ebbrt;
+
+std::array<heap_profile_cpu, MAX_NUM_CPUS> ebbrt::heap_profile_cpus;
+
+namespace {
+const constexpr size_t MAX_FRAMES = 8;
+// a caller's frame further than this above ours is assumed to be garbage
+const constexpr uintptr_t MAX_FRAME_SIZE = 1 << 20;
+const constexpr size_t RING_SIZE = 256;
+const constexpr size_t LIVE_SHIFT = 11;
+const constexpr size_t LIVE_SLOTS = 1 << LIVE_SHIFT;
+const constexpr size_t MAX_SITES = 256;
+// how often a core with profiling off checks whether it has been turned on
+const constexpr int64_t DISABLED_RECHECK = 64 * 1024 * 1024;
+const constexpr uintptr_t TOMBSTONE = 1;
+
+struct heap_sample {
+  uintptr_t addr;
+  size_t size;
+  // bytes of allocation this sample stands for
+  size_t weight;
+  std::chrono::nanoseconds time;
+  size_t depth;
+  std::array<uintptr_t, MAX_FRAMES> frames;
+};
+
+// recent samples taken on one core, used to compute allocation rates
+struct sample_ring {
+  spinlock lock;
+  size_t head;
+  std::array<heap_sample, RING_SIZE> samples;
+};
+
+struct heap_site {
+  size_t depth;
+  std::array<uintptr_t, MAX_FRAMES> frames;
+  size_t live_bytes;
+  size_t live_samples;
+  size_t recent_bytes;
+};
+
+std::atomic<size_t> sample_period;
+std::array<sample_ring *, MAX_NUM_CPUS> rings;
+
+// samples not yet freed, open addressed by object address
+spinlock live_lock;
+heap_sample *live;
+size_t live_dropped;
+
+size_t bytes_to_order(size_t bytes) {
+  size_t order = 0;
+  while ((PAGE_SIZE << order) < bytes)
+    ++order;
+  return order;
+}
+
+// The profiler's own memory comes straight from the page allocator so it
+// never samples itself
+void *alloc_pages(size_t bytes) {
+  auto pfn = page_allocator->Alloc(bytes_to_order(bytes));
+  kbugon(pfn == NO_PFN, "Heap profiler failed to allocate memory\n");
+  return reinterpret_cast<void *>(pfn_to_addr(pfn));
+}
+
+void free_pages(void *addr, size_t bytes) {
+  page_allocator->Free(pfn_down(addr), bytes_to_order(bytes));
+}
+
+size_t next_interval(heap_profile_cpu &state, size_t period) {
+  // pick uniformly from [period / 2, 3 * period / 2) so that periodic
+  // allocation patterns don't alias with the sampling interval
+  if (state.rand == 0)
+    state.rand = rdtsc() | 1;
+  state.rand ^= state.rand << 13;
+  state.rand ^= state.rand >> 7;
+  state.rand ^= state.rand << 17;
+  return period / 2 + state.rand % period;
+}
+
+size_t backtrace(void *frame, std::array<uintptr_t, MAX_FRAMES> &frames) {
+  // Each frame begins with the caller's frame pointer followed by the return
+  // address. Stacks grow down so every caller's frame must lie above ours.
+  auto fp = static_cast<uintptr_t *>(frame);
+  size_t depth = 0;
+  while (depth < MAX_FRAMES) {
+    auto ret = fp[1];
+    if (ret == 0)
+      break;
+    frames[depth++] = ret;
+
+    auto next = reinterpret_cast<uintptr_t *>(fp[0]);
+    if (next <= fp || uintptr_t(next) - uintptr_t(fp) > MAX_FRAME_SIZE ||
+        uintptr_t(next) & 7)
+      break;
+    fp = next;
+  }
+  return depth;
+}
+
+size_t live_hash(uintptr_t addr) {
+  return ((addr >> 3) * 0x9E3779B97F4A7C15ull) >> (64 - LIVE_SHIFT);
+}
+
+bool live_insert(const heap_sample &sample) {
+  auto idx = live_hash(sample.addr);
+  for (size_t i = 0; i < LIVE_SLOTS; ++i) {
+    auto &slot = live[(idx + i) % LIVE_SLOTS];
+    if (slot.addr == 0 || slot.addr == TOMBSTONE) {
+      slot = sample;
+      return true;
+    }
+  }
+  ++live_dropped;
+  return false;
+}
+
+bool live_remove(uintptr_t addr) {
+  auto idx = live_hash(addr);
+  for (size_t i = 0; i < LIVE_SLOTS; ++i) {
+    auto &slot = live[(idx + i) % LIVE_SLOTS];
+    if (slot.addr == 0)
+      return false;
+    if (slot.addr == addr) {
+      slot.addr = TOMBSTONE;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Drop every live sample along with its page's count. Called with live_lock
+// held.
+void live_clear() {
+  if (live == nullptr)
+    return;
+  for (size_t i = 0; i < LIVE_SLOTS; ++i) {
+    auto addr = live[i].addr;
+    if (addr != 0 && addr != TOMBSTONE) {
+      auto page = addr_to_page(reinterpret_cast<void *>(addr));
+      kassert(page != nullptr);
+      page->heap_samples = 0;
+    }
+    live[i].addr = 0;
+  }
+  live_dropped = 0;
+}
+
+heap_site *find_site(heap_site *sites, size_t &nsites,
+                     const heap_sample &sample) {
+  for (size_t i = 0; i < nsites; ++i) {
+    if (sites[i].depth == sample.depth &&
+        std::equal(sample.frames.begin(), sample.frames.begin() + sample.depth,
+                   sites[i].frames.begin()))
+      return &sites[i];
+  }
+  if (nsites == MAX_SITES)
+    return nullptr;
+
+  auto &site = sites[nsites++];
+  site = heap_site();
+  site.depth = sample.depth;
+  site.frames = sample.frames;
+  return &site;
+}
+}
+
+void ebbrt::heap_profile_start(size_t period) {
+  kassert(period > 0);
+  {
+    std::lock_guard<spinlock> lock(live_lock);
+    if (live == nullptr) {
+      live = static_cast<heap_sample *>(
+          alloc_pages(LIVE_SLOTS * sizeof(heap_sample)));
+      for (size_t i = 0; i < LIVE_SLOTS; ++i)
+        live[i].addr = 0;
+    }
+    live_clear();
+  }
+
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    if (rings[i] == nullptr) {
+      rings[i] = new (alloc_pages(sizeof(sample_ring))) sample_ring();
+    } else {
+      std::lock_guard<spinlock> lock(rings[i]->lock);
+      rings[i]->head = 0;
+    }
+    // make the core take the slow path on its next allocation, from the core
+    // itself as only it writes its countdown
+    event_manager->SpawnRemote([i]() {
+      heap_profile_cpus[i].countdown.store(0, std::memory_order_relaxed);
+    }, i);
+  }
+
+  sample_period.store(period, std::memory_order_release);
+}
+
+void ebbrt::heap_profile_stop() {
+  sample_period.store(0, std::memory_order_release);
+  // with the pages' counts cleared, frees skip the profiler entirely
+  std::lock_guard<spinlock> lock(live_lock);
+  live_clear();
+}
+
+void ebbrt::heap_profile_sample(void *addr, size_t size) {
+  auto &state = heap_profile_cpus[my_cpu()];
+  auto period = sample_period.load(std::memory_order_acquire);
+  if (period == 0) {
+    state.countdown.store(DISABLED_RECHECK, std::memory_order_relaxed);
+    return;
+  }
+  state.countdown.store(next_interval(state, period),
+                        std::memory_order_relaxed);
+
+  heap_sample sample;
+  sample.addr = reinterpret_cast<uintptr_t>(addr);
+  sample.size = size;
+  sample.weight = std::max(size, period);
+  sample.time = clock_time();
+  sample.depth = backtrace(__builtin_frame_address(0), sample.frames);
+
+  auto ring = rings[my_cpu()];
+  {
+    std::lock_guard<spinlock> lock(ring->lock);
+    ring->samples[ring->head++ % RING_SIZE] = sample;
+  }
+
+  std::lock_guard<spinlock> lock(live_lock);
+  // heap_profile_stop may have cleared the samples since period was read
+  if (sample_period.load(std::memory_order_relaxed) == 0)
+    return;
+  if (live_insert(sample)) {
+    // count the sample on its page so Free only looks up objects that might
+    // be sampled
+    auto page = addr_to_page(addr);
+    kassert(page != nullptr);
+    if (page->heap_samples < page::MAX_HEAP_SAMPLES)
+      ++page->heap_samples;
+  }
+}
+
+void ebbrt::heap_profile_sampled_free(void *addr, page &pg) {
+  std::lock_guard<spinlock> lock(live_lock);
+  if (live != nullptr && live_remove(reinterpret_cast<uintptr_t>(addr)) &&
+      pg.heap_samples < page::MAX_HEAP_SAMPLES)
+    --pg.heap_samples;
+}
+
+void ebbrt::heap_profile_dump() {
+  auto sites =
+      static_cast<heap_site *>(alloc_pages(MAX_SITES * sizeof(heap_site)));
+  size_t nsites = 0;
+  size_t total_live = 0;
+  size_t dropped;
+  {
+    std::lock_guard<spinlock> lock(live_lock);
+    dropped = live_dropped;
+    for (size_t i = 0; live != nullptr && i < LIVE_SLOTS; ++i) {
+      if (live[i].addr == 0 || live[i].addr == TOMBSTONE)
+        continue;
+      total_live += live[i].weight;
+      auto site = find_site(sites, nsites, live[i]);
+      if (site == nullptr)
+        continue;
+      site->live_bytes += live[i].weight;
+      ++site->live_samples;
+    }
+  }
+
+  auto now = clock_time();
+  auto window_start = now;
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    auto ring = rings[i];
+    if (ring == nullptr)
+      continue;
+    std::lock_guard<spinlock> lock(ring->lock);
+    auto n = std::min(ring->head, RING_SIZE);
+    for (size_t j = 0; j < n; ++j) {
+      const auto &sample = ring->samples[j];
+      window_start = std::min(window_start, sample.time);
+      auto site = find_site(sites, nsites, sample);
+      if (site != nullptr)
+        site->recent_bytes += sample.weight;
+    }
+  }
+  auto window_ms = std::max<int64_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(now - window_start)
+          .count(),
+      1);
+
+  std::sort(sites, sites + nsites, [](const heap_site &a, const heap_site &b) {
+    if (a.live_bytes != b.live_bytes)
+      return a.live_bytes > b.live_bytes;
+    return a.recent_bytes > b.recent_bytes;
+  });
+
+  kprintf("Heap profile: ~%zu bytes live, %zu samples not tracked\n",
+          total_live, dropped);
+  for (size_t i = 0; i < nsites; ++i) {
+    kprintf("%zu bytes live in %zu samples, %zu bytes/s allocated\n",
+            sites[i].live_bytes, sites[i].live_samples,
+            size_t(sites[i].recent_bytes * 1000 / window_ms));
+    for (size_t j = 0; j < sites[i].depth; ++j) {
+      kprintf("    %#018" PRIxPTR "\n", sites[i].frames[j]);
+    }
+  }
+
+  free_pages(sites, MAX_SITES * sizeof(heap_site));
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include <sys/cache_aligned.hpp>
+#include <sys/cpu.hpp>
+#include <sys/mem_map.hpp>
+
+namespace ebbrt {
+// The heap profiler samples slab allocations roughly once every
+// sample_period bytes. It is off until heap_profile_start is called, and
+// the cost per allocation is then one counter update per core. Samples are
+// charged to the call stack found by walking frame pointers, so code built
+// without them shows up truncated. Stopping drops the samples still live, so
+// dump first to see them.
+void heap_profile_start(size_t sample_period = 512 * 1024);
+void heap_profile_stop();
+// Print live bytes and recent allocation rate grouped by call stack
+void heap_profile_dump();
+
+struct heap_profile_cpu : cache_aligned {
+  std::atomic<int64_t> countdown;
+  uint64_t rand;
+};
+
+extern std::array<heap_profile_cpu, MAX_NUM_CPUS> heap_profile_cpus;
+
+void heap_profile_sample(void *addr, size_t size);
+void heap_profile_sampled_free(void *addr, page &pg);
+
+inline void heap_profile_alloc(void *addr, size_t size) {
+  // only this core writes its countdown, so no locked update is needed
+  auto &state = heap_profile_cpus[my_cpu()];
+  auto countdown =
+      state.countdown.load(std::memory_order_relaxed) - int64_t(size);
+  state.countdown.store(countdown, std::memory_order_relaxed);
+  if (countdown < 0)
+    heap_profile_sample(addr, size);
+}
+
+// Only frees on a page with live samples take the profiler's lock, none do
+// once profiling is stopped
+inline void heap_profile_free(void *addr, page &pg) {
+  if (pg.heap_samples != 0)
+    heap_profile_sampled_free(addr, pg);
+}
+}
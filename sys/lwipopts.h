@@ -9,10 +9,13 @@
 #define MEMP_NUM_UDP_PCB 20
 #define MEMP_NUM_TCP_PCB 20
 #define MEMP_NUM_TCP_PCB_LISTEN 16
-#define MEMP_NUM_TCP_SEG 128
+#define MEMP_NUM_TCP_SEG 256
 #define MEMP_NUM_REASSDATA 32
 #define MEMP_NUM_ARP_QUEUE 10
 #define PBUF_POOL_SIZE 512
+// sized for a 1500 byte MTU as before, rather than from the larger TCP_MSS
+#define PBUF_POOL_BUFSIZE LWIP_MEM_ALIGN_SIZE(1460 + 40 + PBUF_LINK_HLEN)
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
 #define LWIP_ARP 1
 #define IP_REASS_MAX_PBUFS 64
 #define IP_FRAG_USES_STATIC_BUF 0
@@ -25,9 +28,14 @@
 #define LWIP_RAW 1
 #define LWIP_DHCP 1
 #define LWIP_DNS 1
-#define TCP_WND (4 * TCP_MSS)
-#define TCP_MSS 1460
-#define TCP_SND_BUF (8 * TCP_MSS)
+// Close to the 64 KiB limit without window scaling, so the segments of a
+// flight can go to the device as one large frame
+#define TCP_WND 64240
+// Enough for a 9000 byte MTU, lwIP lowers it to fit the interface
+#define TCP_MSS 8960
+#define TCP_SND_BUF 64240
+// room for a full send buffer of 1460 byte segments
+#define TCP_SND_QUEUELEN (4 * TCP_SND_BUF / 1460)
 #define TCP_LISTEN_BACKLOG 1
 #define LWIP_NETIF_STATUS_CALLBACK 1
 #define LWIP_NETIF_LINK_CALLBACK 1
@@ -42,6 +50,12 @@
 #define ETHARP_TRUST_IP_MAC 0
 #define ETH_PAD_SIZE 2
 #define LWIP_CHKSUM_ALGORITHM 2
+// The network driver checksums TCP and UDP, or has the device do so. lwIP
+// 1.4 can only turn these off for every interface.
+#define CHECKSUM_GEN_TCP 0
+#define CHECKSUM_GEN_UDP 0
+#define CHECKSUM_CHECK_TCP 0
+#define CHECKSUM_CHECK_UDP 0
 
 #define LWIP_DEBUG 1
 #define LWIP_DBG_MIN_LEVEL LWIP_DBG_LEVEL_ALL
@@ -24,6 +24,7 @@
 #include <sys/slab_allocator.hpp>
 #include <sys/smp.hpp>
 #include <sys/timer.hpp>
+#include <sys/tlb.hpp>
 #include <sys/tls.hpp>
 #include <sys/trans.hpp>
 #include <sys/virtio_net.hpp>
@@ -98,11 +99,14 @@ extern "C"
   EbbAllocator::Init();
   VMemAllocator::Init();
   EventManager::Init();
+  event_manager->AddIdleHandler(
+      []() { return page_allocator->RefillZeroed(); });
 
   event_manager->SpawnLocal([]() {
     // Enable exceptions
     __register_frame(__eh_frame_start);
     apic_init();
+    tlb_init();
     ApicTimer::Init();
     smp_init();
     NetworkManager::Init();
@@ -1,3 +1,6 @@
+#include <atomic>
+#include <cstring>
+
 #include <sys/align.hpp>
 #include <sys/early_page_allocator.hpp>
 #include <sys/mem_map.hpp>
@@ -5,7 +8,51 @@
 
 using namespace ebbrt;
 
-std::array<mem_section, NUM_MEM_SECTIONS> ebbrt::sections;
+std::array<mem_section *, NUM_SECTION_ROOTS> ebbrt::section_roots;
+
+namespace {
+// Memory below this is needed before SMP comes up (the early page tables,
+// the AP stacks and trampoline) so its sections are always initialized at boot
+const constexpr uint64_t EARLY_INIT_END = 1 << 30;
+// beyond that, each node gets this many sections up front so its cores can
+// allocate while they come up
+const constexpr size_t EARLY_SECTIONS_PER_NODE = 2;
+
+struct deferred_section {
+  size_t index;
+  uintptr_t map_addr;
+};
+
+// Sections are claimed by bumping next, so the cores of a node can work
+// through them in parallel
+struct deferred_list {
+  deferred_section *sections;
+  size_t size;
+  std::atomic<size_t> next;
+};
+
+std::array<deferred_list, MAX_NUMA_NODES> deferred;
+
+const constexpr size_t section_map_bytes = PAGES_PER_SECTION * sizeof(page);
+
+template <typename F> void for_each_section(F f) {
+  for (size_t i = 0; i < section_roots.size(); ++i) {
+    auto root = section_roots[i];
+    if (root == nullptr)
+      continue;
+    for (size_t j = 0; j < SECTIONS_PER_ROOT; ++j) {
+      f(i * SECTIONS_PER_ROOT + j, root[j]);
+    }
+  }
+}
+
+void init_section_map(uintptr_t map_addr, nid_t nid) {
+  auto map = reinterpret_cast<page *>(map_addr);
+  for (unsigned j = 0; j < PAGES_PER_SECTION; j++) {
+    new (reinterpret_cast<void *>(&map[j])) page(nid);
+  }
+}
+}
 
 void ebbrt::mem_map_init() {
   for (const auto &node : numa_nodes) {
@@ -16,28 +63,87 @@ void ebbrt::mem_map_init() {
 
       start &= PAGE_SECTION_MASK;
       for (auto pfn = start; pfn < end; pfn += PAGES_PER_SECTION) {
-        auto &section = pfn_to_section(pfn);
-        if (!section.present()) {
-          section.set_early_nid(nid);
+        auto root_num = pfn_to_section_num(pfn) / SECTIONS_PER_ROOT;
+        auto &root = section_roots[root_num];
+        if (root == nullptr) {
+          auto root_pfn = early_allocate_page(1, nid);
+          root = reinterpret_cast<mem_section *>(pfn_to_addr(root_pfn));
+          std::memset(root, 0, PAGE_SIZE);
+        }
+        auto section = pfn_to_section(pfn);
+        if (!section->present()) {
+          section->set_early_nid(nid);
         }
       }
     }
   }
 
-  const auto section_map_bytes = PAGES_PER_SECTION * sizeof(page);
+  // Constructing every struct page up front dominates boot on large
+  // machines, so only the sections needed to get SMP running are done here.
+  // The rest get their map allocated now but are left for
+  // mem_map_init_deferred and look absent to pfn_to_page until then.
+  std::array<size_t, MAX_NUMA_NODES> early_sections;
+  auto init_early = [&early_sections](size_t i, nid_t nid) {
+    auto addr = pfn_to_addr(pfn_t(size_t(i) << PFN_SECTION_SHIFT));
+    if (addr >= EARLY_INIT_END &&
+        early_sections[nid] >= EARLY_SECTIONS_PER_NODE)
+      return false;
+    ++early_sections[nid];
+    return true;
+  };
+
+  early_sections.fill(0);
+  for_each_section([&](size_t i, mem_section &section) {
+    if (section.present()) {
+      auto nid = section.early_get_nid();
+      if (!init_early(i, nid))
+        ++deferred[nid].size;
+    }
+  });
+
+  for (unsigned i = 0; i < numa_nodes.size(); ++i) {
+    auto &list = deferred[i];
+    if (list.size == 0)
+      continue;
+    auto bytes = list.size * sizeof(deferred_section);
+    auto pfn = early_allocate_page(align_up(bytes, PAGE_SIZE) >> PAGE_SHIFT,
+                                   nid_t(i));
+    list.sections = reinterpret_cast<deferred_section *>(pfn_to_addr(pfn));
+    list.size = 0;
+  }
+
   const auto section_map_pages =
       align_up(section_map_bytes, PAGE_SIZE) >> PAGE_SHIFT;
-  for (unsigned i = 0; i < sections.size(); ++i) {
-    auto &section = sections[i];
+  early_sections.fill(0);
+  for_each_section([&](size_t i, mem_section &section) {
     if (section.present()) {
       auto nid = section.early_get_nid();
       auto map_pfn = early_allocate_page(section_map_pages, nid);
       auto map_addr = pfn_to_addr(map_pfn);
-      auto map = reinterpret_cast<page*>(map_addr);
-      for (unsigned j = 0; j < PAGES_PER_SECTION; j++) {
-        new (reinterpret_cast<void*>(&map[j])) page(nid);
+      if (init_early(i, nid)) {
+        init_section_map(map_addr, nid);
+        section.set_map(map_addr, i);
+      } else {
+        auto &list = deferred[nid];
+        list.sections[list.size++] = deferred_section{ i, map_addr };
       }
-      section.set_map(map_addr, i);
     }
-  }
+  });
+}
+
+bool ebbrt::mem_map_init_deferred(nid_t nid, pfn_t &start, pfn_t &end) {
+  auto &list = deferred[nid];
+  auto i = list.next.fetch_add(1, std::memory_order_relaxed);
+  if (i >= list.size)
+    return false;
+
+  const auto &entry = list.sections[i];
+  init_section_map(entry.map_addr, nid);
+  // the pages must be visible before the section is
+  std::atomic_thread_fence(std::memory_order_release);
+  section_num_to_section(entry.index)->set_map(entry.map_addr, entry.index);
+
+  start = pfn_t(entry.index << PFN_SECTION_SHIFT);
+  end = start + PAGES_PER_SECTION;
+  return true;
 }
@@ -35,6 +35,11 @@ struct page {
                 "Not enough space to store nid in struct page");
   uint8_t nid;
 
+  // Objects starting on this page the heap profiler has live samples of,
+  // sticks once it reaches MAX_HEAP_SAMPLES
+  static const constexpr uint8_t MAX_HEAP_SAMPLES = 255;
+  uint8_t heap_samples;
+
   union data {
     uint8_t order;
     struct slab_data {
@@ -46,10 +51,15 @@ struct page {
     } __attribute__((packed)) slab_data;
   } __attribute__((packed)) data;
 
-  page(nid_t nid) : usage{ Usage::RESERVED }, nid{(uint8_t)nid } {}
+  page(nid_t nid)
+      : usage{ Usage::RESERVED }, nid{(uint8_t)nid }, heap_samples{ 0 } {}
 } __attribute__((packed));
 
 void mem_map_init();
+// Initialize the struct pages of one section deferred by mem_map_init. Returns
+// false once node nid has none left, otherwise the section's frames in
+// [start, end).
+bool mem_map_init_deferred(nid_t nid, pfn_t &start, pfn_t &end);
 
 class mem_section {
   uintptr_t mem_map;
@@ -60,6 +70,7 @@ class mem_section {
   static const constexpr size_t NID_SHIFT = 2;
   page *map_addr() { return reinterpret_cast<page *>(mem_map & MAP_MASK); }
   friend void mem_map_init();
+  friend bool mem_map_init_deferred(nid_t nid, pfn_t &start, pfn_t &end);
   void set_early_nid(nid_t nid) {
     mem_map = (((uintptr_t)nid) << NID_SHIFT) | PRESENT;
   }
@@ -73,7 +84,7 @@ class mem_section {
 
 public:
   bool present() const { return mem_map & PRESENT; }
-  bool valid() const { return mem_map & MAP_MASK; }
+  bool valid() const { return mem_map & HAS_MEM_MAP; }
   page *get_page(pfn_t pfn) {
     // mem_map encodes the starting frame so we can just index off it
     // e.g.: mem_map = mem_map_address - start_pfn
@@ -81,20 +92,32 @@ public:
   }
 };
 
-extern std::array<mem_section, NUM_MEM_SECTIONS> sections;
+// Sections are kept in a sparse two level table: the root points to pages of
+// sections which are only allocated for ranges with memory present
+const constexpr size_t SECTIONS_PER_ROOT = PAGE_SIZE / sizeof(mem_section);
+const constexpr size_t NUM_SECTION_ROOTS = NUM_MEM_SECTIONS / SECTIONS_PER_ROOT;
+
+extern std::array<mem_section *, NUM_SECTION_ROOTS> section_roots;
 
 inline size_t pfn_to_section_num(pfn_t pfn) { return pfn >> PFN_SECTION_SHIFT; }
 
-inline mem_section &pfn_to_section(pfn_t pfn) {
-  return sections[pfn_to_section_num(pfn)];
+inline mem_section *section_num_to_section(size_t num) {
+  auto root = section_roots[num / SECTIONS_PER_ROOT];
+  if (root == nullptr)
+    return nullptr;
+  return &root[num % SECTIONS_PER_ROOT];
+}
+
+inline mem_section *pfn_to_section(pfn_t pfn) {
+  return section_num_to_section(pfn_to_section_num(pfn));
 }
 
 inline page *pfn_to_page(pfn_t pfn) {
   auto section = pfn_to_section(pfn);
-  if (!section.valid() || !section.present()) {
+  if (section == nullptr || !section->valid()) {
     return nullptr;
   }
-  return section.get_page(pfn);
+  return section->get_page(pfn);
 }
 
 inline page *addr_to_page(uintptr_t addr) {
@@ -1,30 +1,117 @@
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
+#include <limits>
+#include <tuple>
 
 #include <lwip/dhcp.h>
 #include <lwip/init.h>
 #include <lwip/stats.h>
 #include <lwip/sys.h>
 #include <lwip/tcp.h>
+#include <lwip/tcp_impl.h>
 #include <lwip/timers.h>
 #include <netif/etharp.h>
 
 #include <sys/arch/cc.h>
 #include <sys/clock.hpp>
+#include <sys/cpu.hpp>
 #include <sys/debug.hpp>
 #include <sys/event_manager.hpp>
 #include <sys/explicitly_constructed.hpp>
 #include <sys/net.hpp>
+#include <sys/object_cache.hpp>
 #include <sys/timer.hpp>
 
 using namespace ebbrt;
 
-namespace { explicitly_constructed<NetworkManager> the_manager; }
+lwip_mutex ebbrt::lwip_lock;
+
+void lwip_mutex::lock() {
+  size_t self = my_cpu() + 1;
+  if (owner_.load(std::memory_order_relaxed) == self) {
+    ++depth_;
+    return;
+  }
+  lock_.lock();
+  owner_.store(self, std::memory_order_relaxed);
+  depth_ = 1;
+}
+
+void lwip_mutex::unlock() {
+  if (--depth_ > 0)
+    return;
+  owner_.store(0, std::memory_order_relaxed);
+  lock_.unlock();
+}
+
+namespace {
+explicitly_constructed<NetworkManager> the_manager;
+
+// A received frame handed to lwIP in place. The device buffer it lies in is
+// released with free() once lwIP and the application drop the last pbuf
+// referencing it.
+struct rx_pbuf {
+  struct pbuf_custom p;
+  void* buf;
+};
+
+explicitly_constructed<ObjectCache<rx_pbuf>> rx_pbufs;
+
+void rx_pbuf_free(struct pbuf* p) {
+  auto rx = reinterpret_cast<rx_pbuf*>(p);
+  std::free(rx->buf);
+  rx_pbufs->Free(rx);
+}
+
+// Data of a Tcp_pcb written to lwIP without copying. The device may still be
+// sending a retransmission of it after it has been acknowledged and dropped
+// from the send queue, so the pbuf holds its own reference to the buffer.
+struct tx_pbuf {
+  struct pbuf_custom p;
+  explicitly_constructed<const_buffer> buf;
+};
+
+explicitly_constructed<ObjectCache<tx_pbuf>> tx_pbufs;
+
+void tx_pbuf_free(struct pbuf* p) {
+  auto tx = reinterpret_cast<tx_pbuf*>(p);
+  tx->buf.destruct();
+  tx_pbufs->Free(tx);
+}
+
+struct tcp_pcb* new_tcp_pcb() {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  return tcp_new();
+}
+
+// Takes over the caller's reference to p. Each buffer holds a reference to
+// its own pbuf so they can be released in any order.
+const_buffer_list pbuf_to_buffers(struct pbuf* p) {
+  const_buffer_list l;
+  auto it = l.before_begin();
+  for (auto q = p; q != nullptr; q = q->next) {
+    if (q->len == 0)
+      continue;
+    pbuf_ref(q);
+    it = l.emplace_after(it, q->payload, q->len, [q](const void*) {
+      std::lock_guard<lwip_mutex> lock{ lwip_lock };
+      pbuf_free(q);
+    });
+  }
+  pbuf_free(p);
+  return l;
+}
+}
 
 void NetworkManager::Init() {
   the_manager.construct();
+  rx_pbufs.construct();
+  tx_pbufs.construct();
   lwip_init();
   timer->Start(std::chrono::milliseconds(10),
                []() {
+    std::lock_guard<lwip_mutex> lock{ lwip_lock };
     sys_check_timeouts();
   });
 }
@@ -38,21 +125,40 @@ NetworkManager& NetworkManager::HandleFault(EbbId id) {
 
 NetworkManager::Interface& NetworkManager::NewInterface(
     EthernetDevice& ether_dev) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
   interfaces_.emplace_back(ether_dev, interfaces_.size());
   return interfaces_[interfaces_.size() - 1];
 }
 
+void NetworkManager::BeginSendBatch() {
+  for (auto& itf : interfaces_) {
+    itf.BeginSendBatch();
+  }
+}
+
+void NetworkManager::EndSendBatch() {
+  for (auto& itf : interfaces_) {
+    itf.EndSendBatch();
+  }
+}
+
 namespace { EventManager::EventContext* context; }
 
 void NetworkManager::AcquireIPAddress() {
   kbugon(interfaces_.size() == 0, "No network interfaces identified!\n");
-  netif_set_default(&interfaces_[0].netif_);
-  dhcp_start(&interfaces_[0].netif_);
+  {
+    std::lock_guard<lwip_mutex> lock{ lwip_lock };
+    netif_set_default(&interfaces_[0].netif_);
+    dhcp_start(&interfaces_[0].netif_);
+  }
   context = new EventManager::EventContext;
   event_manager->SaveContext(*context);
 }
 
 namespace {
+// the least IPv4 allows a link
+const constexpr uint16_t MIN_MTU = 68;
+
 err_t eth_output(struct netif* netif, struct pbuf* p) {
   auto itf = static_cast<NetworkManager::Interface*>(netif->state);
 
@@ -60,28 +166,16 @@ err_t eth_output(struct netif* netif, struct pbuf* p) {
   pbuf_header(p, -ETH_PAD_SIZE);
 #endif
 
-  const_buffer_list l;
-  for (struct pbuf* q = p; q != nullptr; q = q->next) {
-    if (q->next == nullptr) {
-      l.emplace_front(q->payload,
-                      q->len,
-                      [ = ](const void*) {
-        pbuf_free(p);
-      });
-    } else {
-      l.emplace_front(q->payload,
-                      q->len,
-                      [](const void*) {
-      });
-    }
-  }
-  itf->Send(std::move(l));
-  pbuf_ref(p);
+  auto sent = itf->Send(p);
 
 #if ETH_PAD_SIZE
   pbuf_header(p, ETH_PAD_SIZE);
 #endif
 
+  // Only frames lwIP does not retry are refused, UDP senders see the error
+  if (!sent)
+    return ERR_MEM;
+
   LINK_STATS_INC(link.xmit);
 
   return ERR_OK;
@@ -91,7 +185,6 @@ err_t eth_init(struct netif* netif) {
   auto itf = static_cast<NetworkManager::Interface*>(netif->state);
   netif->hwaddr_len = 6;
   memcpy(netif->hwaddr, itf->MacAddress().data(), 6);
-  netif->mtu = 1500;
   netif->name[0] = 'e';
   netif->name[1] = 'n';
   netif->output = etharp_output;
@@ -123,36 +216,63 @@ NetworkManager::Interface::Interface(EthernetDevice& ether_dev, size_t idx)
     throw std::runtime_error("Failed to create network interface");
   }
   netif_set_status_callback(&netif_, status_callback);
+  netif_.mtu = ether_dev_.get_mtu();
 }
 
 const std::array<char, 6>& NetworkManager::Interface::MacAddress() {
   return ether_dev_.get_mac_address();
 }
 
+void NetworkManager::Interface::SetMtu(uint16_t mtu) {
+  if (mtu < MIN_MTU || mtu > ether_dev_.get_max_mtu())
+    throw std::runtime_error("MTU not supported by the device\n");
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  netif_.mtu = mtu;
+}
+
 void NetworkManager::Interface::Send(const_buffer_list l) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
   ether_dev_.send(std::move(l));
 }
 
-void NetworkManager::Interface::ReceivePacket(mutable_buffer buf,
-                                              uint32_t len) {
-  //FIXME: We should avoid this copy
-  auto p = pbuf_alloc(PBUF_LINK, len + ETH_PAD_SIZE, PBUF_POOL);
+bool NetworkManager::Interface::Send(struct pbuf* p) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  return ether_dev_.send_pbuf(p);
+}
 
-  kbugon(p == nullptr, "Failed to allocate pbuf");
+void NetworkManager::Interface::BeginSendBatch() {
+  ether_dev_.begin_send_batch();
+}
 
-  auto ptr = buf.addr();
-  bool first = true;
-  for (auto q = p; q != nullptr; q = q->next) {
-    auto add = 0;
-    if (first) {
-      add = ETH_PAD_SIZE;
-      first = false;
-    }
-    memcpy(static_cast<char*>(q->payload) + add, ptr, q->len - add);
-    ptr = static_cast<void*>(static_cast<char*>(ptr) + q->len);
+void NetworkManager::Interface::EndSendBatch() { ether_dev_.end_send_batch(); }
+
+void NetworkManager::Interface::ReceivePacket(mutable_buffer_list bufs) {
+  // The frame is not copied. The driver's header sits in front of it in the
+  // first buffer and has been consumed, so the pad can overlap it.
+  struct pbuf* head = nullptr;
+  for (auto& buf : bufs) {
+    auto data = static_cast<char*>(buf.addr());
+    auto len = buf.size();
+    void* base;
+    size_t size;
+    std::tie(base, size) = buf.release();
+    auto pad = head == nullptr ? ETH_PAD_SIZE : 0;
+    kassert(data - static_cast<char*>(base) >= pad);
+
+    auto rx = rx_pbufs->Alloc();
+    rx->p.custom_free_function = rx_pbuf_free;
+    rx->buf = base;
+    auto p = pbuf_alloced_custom(
+        PBUF_RAW, len + pad, PBUF_REF, &rx->p, data - pad, len + pad);
+    kassert(p != nullptr);
+    if (head == nullptr)
+      head = p;
+    else
+      pbuf_cat(head, p);
   }
 
-  netif_.input(p, &netif_);
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  netif_.input(head, &netif_);
 }
 
 extern "C" void lwip_printf(const char* fmt, ...) {
@@ -177,24 +297,103 @@ u32_t sys_now() {
       .count();
 }
 
-NetworkManager::Tcp_pcb::Tcp_pcb() {
-  pcb_ = tcp_new();
+NetworkManager::Tcp_pcb::Tcp_pcb() : Tcp_pcb(new_tcp_pcb()) {}
+
+NetworkManager::Tcp_pcb::Tcp_pcb(struct tcp_pcb* pcb)
+    : pcb_(pcb),
+      unsent_index_(0),
+      unsent_offset_(0),
+      acked_offset_(0),
+      queued_bytes_(0),
+      acked_bytes_(0),
+      listening_(false),
+      close_pending_(false),
+      shutdown_pending_(false),
+      tx_shut_(false) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
   if (pcb_ == nullptr) {
     throw std::bad_alloc();
   }
-  tcp_arg(pcb_, static_cast<void*>(this));
+  Register();
 }
 
-NetworkManager::Tcp_pcb::Tcp_pcb(struct tcp_pcb* pcb) : pcb_(pcb) {
-  tcp_arg(pcb_, static_cast<void*>(this));
+NetworkManager::Tcp_pcb::Tcp_pcb(Tcp_pcb&& other)
+    : pcb_(other.pcb_),
+      accept_callback_(std::move(other.accept_callback_)),
+      connect_callback_(std::move(other.connect_callback_)),
+      receive_callback_(std::move(other.receive_callback_)),
+      window_callback_(std::move(other.window_callback_)),
+      send_queue_(std::move(other.send_queue_)),
+      unsent_index_(other.unsent_index_),
+      unsent_offset_(other.unsent_offset_),
+      acked_offset_(other.acked_offset_),
+      queued_bytes_(other.queued_bytes_),
+      acked_bytes_(other.acked_bytes_),
+      send_callbacks_(std::move(other.send_callbacks_)),
+      listening_(other.listening_),
+      close_pending_(other.close_pending_),
+      shutdown_pending_(other.shutdown_pending_),
+      tx_shut_(other.tx_shut_) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  other.pcb_ = nullptr;
+  if (pcb_ != nullptr)
+    tcp_arg(pcb_, static_cast<void*>(this));
 }
 
-NetworkManager::Tcp_pcb::~Tcp_pcb() {
+NetworkManager::Tcp_pcb& NetworkManager::Tcp_pcb::operator=(
+    Tcp_pcb&& other) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  if (this == &other)
+    return *this;
+
+  Abort();
+  pcb_ = other.pcb_;
+  other.pcb_ = nullptr;
+  accept_callback_ = std::move(other.accept_callback_);
+  connect_callback_ = std::move(other.connect_callback_);
+  receive_callback_ = std::move(other.receive_callback_);
+  window_callback_ = std::move(other.window_callback_);
+  send_queue_ = std::move(other.send_queue_);
+  unsent_index_ = other.unsent_index_;
+  unsent_offset_ = other.unsent_offset_;
+  acked_offset_ = other.acked_offset_;
+  queued_bytes_ = other.queued_bytes_;
+  acked_bytes_ = other.acked_bytes_;
+  send_callbacks_ = std::move(other.send_callbacks_);
+  listening_ = other.listening_;
+  close_pending_ = other.close_pending_;
+  shutdown_pending_ = other.shutdown_pending_;
+  tx_shut_ = other.tx_shut_;
   if (pcb_ != nullptr)
+    tcp_arg(pcb_, static_cast<void*>(this));
+  return *this;
+}
+
+NetworkManager::Tcp_pcb::~Tcp_pcb() { Abort(); }
+
+void NetworkManager::Tcp_pcb::Register() {
+  tcp_arg(pcb_, static_cast<void*>(this));
+  tcp_recv(pcb_, Receive_Handler);
+  tcp_sent(pcb_, Sent_Handler);
+  tcp_err(pcb_, Error_Handler);
+}
+
+void NetworkManager::Tcp_pcb::Abort() {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  if (pcb_ == nullptr)
+    return;
+  // lwIP would call back into us from tcp_abort
+  tcp_arg(pcb_, nullptr);
+  if (listening_) {
+    tcp_close(pcb_);
+  } else {
     tcp_abort(pcb_);
+  }
+  pcb_ = nullptr;
 }
 
 void NetworkManager::Tcp_pcb::Bind(uint16_t port) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
   auto ret = tcp_bind(pcb_, IP_ADDR_ANY, port);
   if (ret != ERR_OK) {
     throw std::runtime_error("Bind failed\n");
@@ -202,14 +401,17 @@ void NetworkManager::Tcp_pcb::Bind(uint16_t port) {
 }
 
 void NetworkManager::Tcp_pcb::Listen() {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
   auto pcb = tcp_listen(pcb_);
   if (pcb == NULL) {
     throw std::bad_alloc();
   }
   pcb_ = pcb;
+  listening_ = true;
 }
 
 void NetworkManager::Tcp_pcb::Accept(std::function<void(Tcp_pcb)> callback) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
   accept_callback_ = std::move(callback);
   tcp_accept(pcb_, Accept_Handler);
 }
@@ -217,6 +419,7 @@ void NetworkManager::Tcp_pcb::Accept(std::function<void(Tcp_pcb)> callback) {
 void NetworkManager::Tcp_pcb::Connect(struct ip_addr* ip,
                                       uint16_t port,
                                       std::function<void()> callback) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
   connect_callback_ = std::move(callback);
   auto err = tcp_connect(pcb_, ip, port, Connect_Handler);
   if (err != ERR_OK) {
@@ -224,6 +427,237 @@ void NetworkManager::Tcp_pcb::Connect(struct ip_addr* ip,
   }
 }
 
+void NetworkManager::Tcp_pcb::Receive(
+    std::function<void(Tcp_pcb&, const_buffer_list)> callback) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  receive_callback_ = std::move(callback);
+}
+
+void NetworkManager::Tcp_pcb::Send(const_buffer_list l,
+                                   std::function<void()> sent) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  if (pcb_ == nullptr || close_pending_ || shutdown_pending_ || tx_shut_) {
+    throw std::runtime_error("Send on closed connection\n");
+  }
+
+  for (auto& buf : l) {
+    if (buf.size() == 0)
+      continue;
+    queued_bytes_ += buf.size();
+    send_queue_.emplace_back(std::move(buf));
+  }
+
+  if (sent) {
+    if (acked_bytes_ >= queued_bytes_) {
+      sent();
+    } else {
+      send_callbacks_.emplace_back(queued_bytes_, std::move(sent));
+    }
+  }
+
+  Output();
+}
+
+size_t NetworkManager::Tcp_pcb::SendWindow() {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  if (pcb_ == nullptr)
+    return 0;
+  return tcp_sndbuf(pcb_);
+}
+
+void NetworkManager::Tcp_pcb::WindowAvailable(
+    std::function<void(Tcp_pcb&)> callback) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  window_callback_ = std::move(callback);
+}
+
+void NetworkManager::Tcp_pcb::Output() {
+  if (pcb_ == nullptr)
+    return;
+
+  bool written = false;
+  while (unsent_index_ < send_queue_.size()) {
+    const auto& buf = send_queue_[unsent_index_];
+    auto remaining = buf.size() - unsent_offset_;
+    auto len = std::min<size_t>(
+        { remaining, tcp_sndbuf(pcb_), std::numeric_limits<u16_t>::max() });
+    if (len == 0)
+      break;
+
+    // lwIP references the buffer rather than copy it
+    u8_t flags = 0;
+    if (len < remaining || unsent_index_ + 1 < send_queue_.size())
+      flags |= TCP_WRITE_FLAG_MORE;
+    auto addr = static_cast<const char*>(buf.addr()) + unsent_offset_;
+    auto err = tcp_write(pcb_, addr, len, flags);
+    if (err == ERR_MEM)
+      break;
+    if (err != ERR_OK)
+      throw std::runtime_error("tcp_write failed\n");
+    HoldUnsent(buf);
+
+    written = true;
+    unsent_offset_ += len;
+    if (unsent_offset_ == buf.size()) {
+      ++unsent_index_;
+      unsent_offset_ = 0;
+    }
+  }
+
+  // the device may send the segments as one large frame
+  if (written) {
+    network_manager->BeginSendBatch();
+    tcp_output(pcb_);
+    network_manager->EndSendBatch();
+  }
+}
+
+// tcp_write points PBUF_ROM pbufs at the data, which nothing keeps alive once
+// it is acknowledged. Called after each write, so the only ones among the
+// unsent segments are those just made for buf. They are swapped for tx_pbufs
+// holding a reference to it.
+void NetworkManager::Tcp_pcb::HoldUnsent(const const_buffer& buf) {
+  for (auto seg = pcb_->unsent; seg != nullptr; seg = seg->next) {
+    struct pbuf* prev = nullptr;
+    for (auto q = seg->p; q != nullptr; prev = q, q = q->next) {
+      if (q->type != PBUF_ROM)
+        continue;
+
+      kassert(q->ref == 1);
+      auto tx = tx_pbufs->Alloc();
+      tx->p.custom_free_function = tx_pbuf_free;
+      tx->buf.construct(buf);
+      auto r = pbuf_alloced_custom(
+          PBUF_RAW, q->len, PBUF_REF, &tx->p, q->payload, q->len);
+      kassert(r != nullptr);
+      r->tot_len = q->tot_len;
+      r->next = q->next;
+      if (prev == nullptr)
+        seg->p = r;
+      else
+        prev->next = r;
+      q->next = nullptr;
+      pbuf_free(q);
+      q = r;
+    }
+  }
+}
+
+void NetworkManager::Tcp_pcb::Acknowledged(size_t len) {
+  acked_bytes_ += len;
+  acked_offset_ += len;
+  while (unsent_index_ > 0 && acked_offset_ >= send_queue_.front().size()) {
+    acked_offset_ -= send_queue_.front().size();
+    send_queue_.pop_front();
+    --unsent_index_;
+  }
+
+  while (!send_callbacks_.empty() &&
+         send_callbacks_.front().first <= acked_bytes_) {
+    auto sent = std::move(send_callbacks_.front().second);
+    send_callbacks_.pop_front();
+    sent();
+    if (pcb_ == nullptr)
+      return;
+  }
+
+  Output();
+
+  if (send_queue_.empty()) {
+    if (close_pending_) {
+      FinishClose();
+      return;
+    }
+    if (shutdown_pending_) {
+      shutdown_pending_ = false;
+      tx_shut_ = true;
+      tcp_shutdown(pcb_, 0, 1);
+    }
+  }
+
+  if (window_callback_ && unsent_index_ == send_queue_.size() &&
+      tcp_sndbuf(pcb_) > 0) {
+    auto callback = std::move(window_callback_);
+    window_callback_ = nullptr;
+    callback(*this);
+  }
+}
+
+void NetworkManager::Tcp_pcb::Close() {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  receive_callback_ = nullptr;
+  window_callback_ = nullptr;
+  send_callbacks_.clear();
+  if (pcb_ == nullptr)
+    return;
+
+  if (listening_ || send_queue_.empty()) {
+    FinishClose();
+  } else {
+    close_pending_ = true;
+  }
+}
+
+void NetworkManager::Tcp_pcb::FinishClose() {
+  // lwIP frees the pcb once the close completes, it is no longer ours
+  auto pcb = pcb_;
+  pcb_ = nullptr;
+  close_pending_ = false;
+  tcp_arg(pcb, nullptr);
+  if (!listening_) {
+    tcp_recv(pcb, nullptr);
+    tcp_sent(pcb, nullptr);
+    tcp_err(pcb, nullptr);
+  }
+  if (tcp_close(pcb) != ERR_OK) {
+    // out of memory for the FIN, keep trying
+    tcp_poll(pcb, Close_Poll_Handler, 1);
+  }
+}
+
+void NetworkManager::Tcp_pcb::Shutdown(bool rx, bool tx) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  if (rx && tx) {
+    Close();
+    return;
+  }
+  if (pcb_ == nullptr)
+    return;
+
+  if (rx) {
+    receive_callback_ = nullptr;
+    tcp_shutdown(pcb_, 1, 0);
+  }
+  if (tx && !tx_shut_) {
+    if (send_queue_.empty()) {
+      tx_shut_ = true;
+      tcp_shutdown(pcb_, 0, 1);
+    } else {
+      shutdown_pending_ = true;
+    }
+  }
+}
+
+void NetworkManager::Tcp_pcb::SetNoDelay(bool nodelay) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  kassert(pcb_ != nullptr);
+  if (nodelay) {
+    tcp_nagle_disable(pcb_);
+  } else {
+    tcp_nagle_enable(pcb_);
+  }
+}
+
+void NetworkManager::Tcp_pcb::SetKeepAlive(bool keepalive) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  kassert(pcb_ != nullptr);
+  if (keepalive) {
+    ip_set_option(pcb_, SOF_KEEPALIVE);
+  } else {
+    ip_reset_option(pcb_, SOF_KEEPALIVE);
+  }
+}
+
 err_t NetworkManager::Tcp_pcb::Accept_Handler(void* arg,
                                               struct tcp_pcb* newpcb,
                                               err_t err) {
@@ -243,3 +677,239 @@ err_t NetworkManager::Tcp_pcb::Connect_Handler(void* arg,
   pcb_s->connect_callback_();
   return ERR_OK;
 }
+
+err_t NetworkManager::Tcp_pcb::Receive_Handler(void* arg,
+                                               struct tcp_pcb* pcb,
+                                               struct pbuf* p,
+                                               err_t err) {
+  auto pcb_s = static_cast<Tcp_pcb*>(arg);
+  if (p == nullptr) {
+    // both directions are closed now, finish the close for the application
+    if (pcb_s->tx_shut_)
+      pcb_s->FinishClose();
+    if (pcb_s->receive_callback_)
+      pcb_s->receive_callback_(*pcb_s, const_buffer_list());
+    return ERR_OK;
+  }
+
+  tcp_recved(pcb, p->tot_len);
+  if (!pcb_s->receive_callback_) {
+    pbuf_free(p);
+    return ERR_OK;
+  }
+
+  pcb_s->receive_callback_(*pcb_s, pbuf_to_buffers(p));
+  return ERR_OK;
+}
+
+err_t NetworkManager::Tcp_pcb::Sent_Handler(void* arg,
+                                            struct tcp_pcb* pcb,
+                                            u16_t len) {
+  auto pcb_s = static_cast<Tcp_pcb*>(arg);
+  kassert(pcb_s->pcb_ == pcb);
+  pcb_s->Acknowledged(len);
+  return ERR_OK;
+}
+
+err_t NetworkManager::Tcp_pcb::Close_Poll_Handler(void* arg,
+                                                  struct tcp_pcb* pcb) {
+  tcp_close(pcb);
+  return ERR_OK;
+}
+
+void NetworkManager::Tcp_pcb::Error_Handler(void* arg, err_t err) {
+  // lwIP has already freed the pcb
+  auto pcb_s = static_cast<Tcp_pcb*>(arg);
+  if (pcb_s == nullptr)
+    return;
+  pcb_s->pcb_ = nullptr;
+  pcb_s->send_queue_.clear();
+  pcb_s->unsent_index_ = 0;
+  pcb_s->unsent_offset_ = 0;
+  pcb_s->acked_offset_ = 0;
+  pcb_s->send_callbacks_.clear();
+  if (pcb_s->receive_callback_)
+    pcb_s->receive_callback_(*pcb_s, const_buffer_list());
+}
+
+struct NetworkManager::Udp_pcb::receive_state
+    : std::enable_shared_from_this<receive_state> {
+  // nullptr once the Udp_pcb is gone, a flush may still be queued
+  Udp_pcb* pcb;
+  std::function<void(Udp_pcb&, std::vector<datagram>&)> callback;
+  std::vector<datagram> batch;
+  bool flush_pending;
+};
+
+namespace {
+struct pbuf* datagram_pbuf(const const_buffer_list& data) {
+  size_t len = 0;
+  for (const auto& buf : data) {
+    len += buf.size();
+  }
+  if (len > std::numeric_limits<u16_t>::max()) {
+    throw std::runtime_error("Datagram too large\n");
+  }
+
+  auto p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  auto ptr = static_cast<char*>(p->payload);
+  for (const auto& buf : data) {
+    memcpy(ptr, buf.addr(), buf.size());
+    ptr += buf.size();
+  }
+  return p;
+}
+}
+
+NetworkManager::Udp_pcb::Udp_pcb()
+    : state_(std::make_shared<receive_state>()) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  pcb_ = udp_new();
+  if (pcb_ == nullptr) {
+    throw std::bad_alloc();
+  }
+  state_->pcb = this;
+  state_->flush_pending = false;
+  udp_recv(pcb_, Receive_Handler, static_cast<void*>(state_.get()));
+}
+
+NetworkManager::Udp_pcb::Udp_pcb(Udp_pcb&& other)
+    : pcb_(other.pcb_), state_(std::move(other.state_)) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  other.pcb_ = nullptr;
+  if (state_)
+    state_->pcb = this;
+}
+
+NetworkManager::Udp_pcb& NetworkManager::Udp_pcb::operator=(
+    Udp_pcb&& other) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  if (this == &other)
+    return *this;
+
+  if (state_)
+    state_->pcb = nullptr;
+  if (pcb_ != nullptr)
+    udp_remove(pcb_);
+  pcb_ = other.pcb_;
+  other.pcb_ = nullptr;
+  state_ = std::move(other.state_);
+  if (state_)
+    state_->pcb = this;
+  return *this;
+}
+
+NetworkManager::Udp_pcb::~Udp_pcb() {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  if (state_)
+    state_->pcb = nullptr;
+  if (pcb_ != nullptr)
+    udp_remove(pcb_);
+}
+
+void NetworkManager::Udp_pcb::Bind(uint16_t port) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  auto ret = udp_bind(pcb_, IP_ADDR_ANY, port);
+  if (ret != ERR_OK) {
+    throw std::runtime_error("Bind failed\n");
+  }
+}
+
+void NetworkManager::Udp_pcb::Connect(struct ip_addr* ip, uint16_t port) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  auto ret = udp_connect(pcb_, ip, port);
+  if (ret != ERR_OK) {
+    throw std::runtime_error("Connect failed\n");
+  }
+}
+
+void NetworkManager::Udp_pcb::Disconnect() {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  udp_disconnect(pcb_);
+}
+
+void NetworkManager::Udp_pcb::Receive(
+    std::function<void(Udp_pcb&, std::vector<datagram>&)> callback) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  state_->callback = std::move(callback);
+}
+
+bool NetworkManager::Udp_pcb::Send(const const_buffer_list& data) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  auto p = datagram_pbuf(data);
+  auto err = udp_send(pcb_, p);
+  pbuf_free(p);
+  if (err == ERR_MEM)
+    return false;
+  if (err != ERR_OK) {
+    throw std::runtime_error("udp_send failed\n");
+  }
+  return true;
+}
+
+bool NetworkManager::Udp_pcb::SendTo(struct ip_addr* ip,
+                                     uint16_t port,
+                                     const const_buffer_list& data) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  auto p = datagram_pbuf(data);
+  auto err = udp_sendto(pcb_, p, ip, port);
+  pbuf_free(p);
+  if (err == ERR_MEM)
+    return false;
+  if (err != ERR_OK) {
+    throw std::runtime_error("udp_sendto failed\n");
+  }
+  return true;
+}
+
+size_t NetworkManager::Udp_pcb::SendBatch(
+    const std::vector<datagram>& datagrams) {
+  std::lock_guard<lwip_mutex> lock{ lwip_lock };
+  network_manager->BeginSendBatch();
+  size_t sent = 0;
+  try {
+    for (const auto& d : datagrams) {
+      auto addr = d.addr;
+      if (!SendTo(&addr, d.port, d.data))
+        break;
+      ++sent;
+    }
+  }
+  catch (...) {
+    network_manager->EndSendBatch();
+    throw;
+  }
+  network_manager->EndSendBatch();
+  return sent;
+}
+
+void NetworkManager::Udp_pcb::Receive_Handler(void* arg,
+                                              struct udp_pcb* pcb,
+                                              struct pbuf* p,
+                                              struct ip_addr* addr,
+                                              u16_t port) {
+  auto state = static_cast<receive_state*>(arg);
+  if (!state->callback) {
+    pbuf_free(p);
+    return;
+  }
+
+  state->batch.emplace_back(datagram{ *addr, port, pbuf_to_buffers(p) });
+  if (state->flush_pending)
+    return;
+
+  // Everything the device handed us in this event lands in the batch
+  // before the flush runs
+  state->flush_pending = true;
+  auto s = state->shared_from_this();
+  event_manager->SpawnLocal([s]() {
+    std::lock_guard<lwip_mutex> lock{ lwip_lock };
+    s->flush_pending = false;
+    if (s->pcb != nullptr && s->callback)
+      s->callback(*s->pcb, s->batch);
+    s->batch.clear();
+  });
+}
@@ -1,18 +1,56 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <utility>
 #include <vector>
 
 #include <lwip/netif.h>
+#include <lwip/tcp.h>
+#include <lwip/udp.h>
 
 #include <sys/buffer.hpp>
 #include <sys/main.hpp>
+#include <sys/spinlock.hpp>
 #include <sys/trans.hpp>
 
 namespace ebbrt {
+// lwIP is not thread safe, so anything calling into it, freeing a pbuf
+// included, holds lwip_lock. A core may take it again while holding it, as
+// happens when lwIP calls back into the application. Events never nest, so
+// only the holding core can see itself as the owner.
+class lwip_mutex {
+  spinlock lock_;
+  // the holding core + 1, 0 when free
+  std::atomic<size_t> owner_;
+  size_t depth_;
+
+ public:
+  void lock();
+  void unlock();
+};
+
+extern lwip_mutex lwip_lock;
+
 class EthernetDevice {
  public:
   virtual void send(const_buffer_list l) = 0;
+  // Send the frame in p's chain in place. The device takes a pbuf reference
+  // until it is done with the data. While the device's transmit backlog is
+  // over its high-water mark, returns false, without taking the frame, for
+  // anything but TCP. lwIP 1.4 counts a TCP segment as sent whatever the
+  // device says, so those are always backlogged, TCP_SND_QUEUELEN bounding
+  // each connection's share.
+  virtual bool send_pbuf(struct pbuf* p) = 0;
+  // Frames sent between these may share a single device notification
+  virtual void begin_send_batch() {}
+  virtual void end_send_batch() {}
   virtual const std::array<char, 6>& get_mac_address() = 0;
+  // The MTU an interface starts with and the largest it may be set to
+  virtual uint16_t get_mtu() { return 1500; }
+  virtual uint16_t get_max_mtu() { return 1500; }
   virtual ~EthernetDevice() {}
 };
 
@@ -29,27 +67,139 @@ class NetworkManager {
 
    public:
     Interface(EthernetDevice& ether_dev, size_t idx);
-    void ReceivePacket(mutable_buffer buf, uint32_t len);
+    // The frame is the buffers' contents in order
+    void ReceivePacket(mutable_buffer_list bufs);
     void Send(const_buffer_list l);
+    bool Send(struct pbuf* p);
+    void BeginSendBatch();
+    void EndSendBatch();
     const std::array<char, 6>& MacAddress();
+    // Connections already open keep the segment size they started with
+    void SetMtu(uint16_t mtu);
   };
 
   Interface& NewInterface(EthernetDevice& ether_dev);
+  // Frames sent on any interface until EndSendBatch may go to the devices
+  // together. Called with lwip_lock held throughout.
+  void BeginSendBatch();
+  void EndSendBatch();
+  // A Tcp_pcb owns its connection, destroying it aborts the connection. It
+  // must not be destroyed from within one of its own callbacks.
   class Tcp_pcb {
     struct tcp_pcb* pcb_;
     std::function<void(Tcp_pcb)> accept_callback_;
     std::function<void()> connect_callback_;
+    std::function<void(Tcp_pcb&, const_buffer_list)> receive_callback_;
+    std::function<void(Tcp_pcb&)> window_callback_;
+    // Buffers passed to Send are held until acknowledged. The first
+    // unsent_index_ of them have been written to lwIP in full, unsent_offset_
+    // bytes of the next one have been written and acked_offset_ bytes of the
+    // front one have been acknowledged.
+    std::deque<const_buffer> send_queue_;
+    size_t unsent_index_;
+    size_t unsent_offset_;
+    size_t acked_offset_;
+    // byte counts since the connection opened, for completion callbacks
+    uint64_t queued_bytes_;
+    uint64_t acked_bytes_;
+    std::deque<std::pair<uint64_t, std::function<void()>>> send_callbacks_;
+    bool listening_;
+    bool close_pending_;
+    bool shutdown_pending_;
+    bool tx_shut_;
 
     static err_t Accept_Handler(void *arg, struct tcp_pcb * newpcb, err_t err);
     static err_t Connect_Handler(void *arg, struct tcp_pcb * pcb, err_t err);
+    static err_t Receive_Handler(void* arg, struct tcp_pcb* pcb,
+                                 struct pbuf* p, err_t err);
+    static err_t Sent_Handler(void* arg, struct tcp_pcb* pcb, u16_t len);
+    static err_t Close_Poll_Handler(void* arg, struct tcp_pcb* pcb);
+    static void Error_Handler(void* arg, err_t err);
     Tcp_pcb(struct tcp_pcb *pcb);
+    void Register();
+    void Abort();
+    void Output();
+    void HoldUnsent(const const_buffer& buf);
+    void Acknowledged(size_t len);
+    void FinishClose();
    public:
     Tcp_pcb();
+    Tcp_pcb(Tcp_pcb&& other);
+    Tcp_pcb& operator=(Tcp_pcb&& other);
+    Tcp_pcb(const Tcp_pcb&) = delete;
+    Tcp_pcb& operator=(const Tcp_pcb&) = delete;
     ~Tcp_pcb();
     void Bind(uint16_t port);
     void Listen();
     void Accept(std::function<void(Tcp_pcb)> callback);
     void Connect(struct ip_addr *ipaddr, uint16_t port, std::function<void()> callback);
+
+    // Received data is delivered in order and without copying, the pbufs
+    // are released as the buffers are. An empty list means the peer closed
+    // its side or the connection failed.
+    void Receive(std::function<void(Tcp_pcb&, const_buffer_list)> callback);
+    // The data is not copied. Each buffer is held until the peer acknowledges
+    // it, then released, and sent is called once all of l is acknowledged.
+    // Data beyond the send window is queued here.
+    void Send(const_buffer_list l, std::function<void()> sent = nullptr);
+    // Space lwIP has to take more data right away
+    size_t SendWindow();
+    // Called once when all queued data has been handed to lwIP and the send
+    // window is open again
+    void WindowAvailable(std::function<void(Tcp_pcb&)> callback);
+    // Both wait for queued data to be acknowledged before sending the FIN.
+    // After Close no more callbacks are made, destroying the Tcp_pcb before
+    // the data is acknowledged aborts the connection.
+    void Close();
+    void Shutdown(bool rx, bool tx);
+    void SetNoDelay(bool nodelay);
+    void SetKeepAlive(bool keepalive);
+  };
+
+  class Udp_pcb {
+   public:
+    struct datagram {
+      struct ip_addr addr;
+      uint16_t port;
+      const_buffer_list data;
+    };
+
+   private:
+    struct receive_state;
+
+    struct udp_pcb* pcb_;
+    std::shared_ptr<receive_state> state_;
+
+    static void Receive_Handler(void* arg, struct udp_pcb* pcb,
+                                struct pbuf* p, struct ip_addr* addr,
+                                u16_t port);
+
+   public:
+    Udp_pcb();
+    Udp_pcb(Udp_pcb&& other);
+    Udp_pcb& operator=(Udp_pcb&& other);
+    Udp_pcb(const Udp_pcb&) = delete;
+    Udp_pcb& operator=(const Udp_pcb&) = delete;
+    ~Udp_pcb();
+    void Bind(uint16_t port);
+    void Connect(struct ip_addr* ipaddr, uint16_t port);
+    void Disconnect();
+
+    // Datagrams are received without copying and delivered in batches, once
+    // per event with everything that arrived during it. The callback may
+    // move buffers out of the batch, which is reused afterwards.
+    void Receive(
+        std::function<void(Udp_pcb&, std::vector<datagram>&)> callback);
+    // Payloads are copied into a single pbuf per datagram, which costs less
+    // than tracking small buffers until the device is done with them.
+    // Returns false if the datagram was dropped because the device is
+    // backed up.
+    bool Send(const const_buffer_list& data);
+    bool SendTo(struct ip_addr* ipaddr, uint16_t port,
+                const const_buffer_list& data);
+    // Send each datagram to its addr and port, notifying the device once.
+    // Stops at the first datagram dropped and returns how many were sent.
+    size_t SendBatch(const std::vector<datagram>& datagrams);
   };
 
  private:
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <array>
+#include <functional>
+#include <new>
+#include <vector>
+
+#include <sys/cache_aligned.hpp>
+#include <sys/cpu.hpp>
+#include <sys/debug.hpp>
+#include <sys/slab_allocator.hpp>
+
+namespace ebbrt {
+// A typed cache which keeps objects constructed between uses. Free runs the
+// optional reset hook and parks the object on the freeing core, where the
+// next Alloc picks it up without constructing it again. T is only destroyed
+// when that core's cache is full, when the object is freed away from its home
+// node, or when the ObjectCache itself goes away.
+template <typename T> class ObjectCache {
+  struct core_cache : cache_aligned {
+    std::vector<T *> objects;
+  };
+
+  SlabAllocatorRoot *root_;
+  size_t capacity_;
+  std::function<void(T &)> reset_;
+  std::array<core_cache *, MAX_NUM_CPUS> caches_;
+
+  core_cache &my_cache() {
+    auto &cache = caches_[my_cpu()];
+    if (cache == nullptr) {
+      cache = new core_cache;
+      cache->objects.reserve(capacity_);
+    }
+    return *cache;
+  }
+
+  void Destroy(T *obj) {
+    obj->~T();
+    root_->get_cpu_allocator().Free(obj);
+  }
+
+public:
+  static const constexpr size_t DEFAULT_CAPACITY = 64;
+
+  explicit ObjectCache(std::function<void(T &)> reset = nullptr,
+                       size_t capacity = DEFAULT_CAPACITY)
+      : root_{ new SlabAllocatorRoot(sizeof(T), alignof(T)) },
+        capacity_{ capacity }, reset_{ std::move(reset) } {
+    caches_.fill(nullptr);
+  }
+
+  ObjectCache(const ObjectCache &) = delete;
+  ObjectCache &operator=(const ObjectCache &) = delete;
+
+  // Must not race with Alloc or Free on any core
+  ~ObjectCache() {
+    for (auto cache : caches_) {
+      if (cache == nullptr)
+        continue;
+      for (auto obj : cache->objects)
+        Destroy(obj);
+      delete cache;
+    }
+    delete root_;
+  }
+
+  // Objects for another node are always freshly constructed there
+  T *Alloc(nid_t nid = my_node()) {
+    if (nid == my_node()) {
+      auto &cache = my_cache();
+      if (!cache.objects.empty()) {
+        auto ret = cache.objects.back();
+        cache.objects.pop_back();
+        return ret;
+      }
+    }
+
+    auto &allocator = root_->get_cpu_allocator();
+    auto mem = allocator.Alloc(nid);
+    if (mem == nullptr)
+      throw std::bad_alloc();
+    try {
+      return new (mem) T();
+    }
+    catch (...) {
+      allocator.Free(mem);
+      throw;
+    }
+  }
+
+  void Free(T *obj) {
+    auto page = addr_to_page(obj);
+    kassert(page != nullptr);
+    auto &cache = my_cache();
+    if (page->nid != my_node() || cache.objects.size() >= capacity_) {
+      Destroy(obj);
+      return;
+    }
+
+    if (reset_)
+      reset_(*obj);
+    cache.objects.push_back(obj);
+  }
+};
+}
@@ -1,9 +1,13 @@
+#include <algorithm>
+#include <cstring>
+
 #include <boost/container/static_vector.hpp>
 
 #include <sys/align.hpp>
 #include <sys/cpu.hpp>
 #include <sys/debug.hpp>
 #include <sys/early_page_allocator.hpp>
+#include <sys/event_manager.hpp>
 #include <sys/mem_map.hpp>
 #include <sys/page_allocator.hpp>
 
@@ -12,36 +16,140 @@ using namespace ebbrt;
 boost::container::static_vector<PageAllocator, MAX_NUMA_NODES>
 PageAllocator::allocators;
 
+namespace {
+struct free_range {
+  pfn_t start;
+  pfn_t end;
+  nid_t nid;
+};
+
+// The early free ranges, kept so that memory in deferred sections can be
+// released once their struct pages exist. The ranges' own headers live in
+// the free memory and may be overwritten by then.
+free_range *free_ranges;
+size_t num_free_ranges;
+
+pfn_t section_end(pfn_t pfn) {
+  return pfn_t(align_down(uintptr_t(pfn), PAGES_PER_SECTION) +
+               PAGES_PER_SECTION);
+}
+
+void zero_page_nontemporal(void *addr) {
+  // streaming stores keep the zeroes from evicting the cache of whatever the
+  // core runs next
+  auto p = static_cast<uint64_t *>(addr);
+  for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 4) {
+    asm volatile("movnti %[zero], 0(%[p]);"
+                 "movnti %[zero], 8(%[p]);"
+                 "movnti %[zero], 16(%[p]);"
+                 "movnti %[zero], 24(%[p]);"
+                 :
+                 : [zero] "r"(uint64_t(0)), [p] "r"(p + i)
+                 : "memory");
+  }
+  asm volatile("sfence" : : : "memory");
+}
+
+// Split [start, end) into the largest naturally aligned blocks buddy order
+// allows and call f(pfn, order) on each
+template <typename F> void for_each_block(pfn_t start, pfn_t end, F f) {
+  const auto max_order = PageAllocator::MAX_ORDER;
+  kassert(end - start != 0);
+  // compute largest power of two that fits in the range
+  auto largest_pow2 =
+      1 << (sizeof(unsigned int) * 8 - __builtin_clz(end - start) - 1);
+  // find the divide at which point the pages decrease in size
+  auto divide = align_up((uintptr_t)start, largest_pow2);
+  auto pfn = start;
+  // Add all the pages up to the divide
+  while (pfn != divide) {
+    kassert(pfn < divide);
+    size_t order = __builtin_ctz(pfn);
+    order = order > max_order ? max_order : order;
+    f(pfn, order);
+    pfn += 1 << order;
+  }
+  // now add the rest
+  pfn = divide;
+  while (pfn != end) {
+    kassert(pfn < end);
+    auto order = sizeof(unsigned int) * 8 - __builtin_clz(end - pfn) - 1;
+    order = order > max_order ? max_order : order;
+    f(pfn, order);
+    pfn += 1 << order;
+  }
+}
+
+// Marks the head of every block FreeContig will hand back. Heads inside a
+// block keep whatever usage and order a past coalesce left them with, which
+// a buddy being freed, or the multi-block scan, would otherwise trust.
+void mark_contig_in_use(pfn_t start, pfn_t end) {
+  for_each_block(start, end, [](pfn_t pfn, size_t order) {
+    auto page = pfn_to_page(pfn);
+    kassert(page != nullptr);
+    page->usage = page::Usage::IN_USE;
+  });
+}
+}
+
 void PageAllocator::Init() {
   for (unsigned i = 0; i < numa_nodes.size(); ++i) {
     allocators.emplace_back((nid_t)i);
   }
 
+  auto bytes = free_pages->size() * sizeof(free_range);
+  auto pfn = early_allocate_page(align_up(bytes, PAGE_SIZE) >> PAGE_SHIFT);
+  free_ranges = reinterpret_cast<free_range *>(pfn_to_addr(pfn));
   release_free_pages([](pfn_t start, pfn_t end, nid_t nid) {
-    kassert(end - start != 0);
-    // compute largest power of two that fits in the range
-    auto largest_pow2 =
-        1 << (sizeof(unsigned int) * 8 - __builtin_clz(end - start) - 1);
-    // find the divide at which point the pages decrease in size
-    auto divide = align_up((uintptr_t)start, largest_pow2);
-    auto pfn = start;
-    // Add all the pages up to the divide
-    while (pfn != divide) {
-      kassert(pfn < divide);
-      size_t order = __builtin_ctz(pfn);
-      order = order > MAX_ORDER ? MAX_ORDER : order;
-      early_free_page(pfn, order, nid);
-      pfn += 1 << order;
-    }
-    // now add the rest
-    pfn = divide;
-    while (pfn != end) {
-      kassert(pfn < end);
-      auto order = sizeof(unsigned int) * 8 - __builtin_clz(end - pfn) - 1;
-      order = order > MAX_ORDER ? MAX_ORDER : order;
-      early_free_page(pfn, order, nid);
-      pfn += 1 << order;
+    free_ranges[num_free_ranges++] = free_range{ start, end, nid };
+  });
+
+  // Only release memory whose section has been initialized, the rest waits
+  // for InitDeferred
+  for (size_t i = 0; i < num_free_ranges; ++i) {
+    const auto &range = free_ranges[i];
+    auto pfn = range.start;
+    while (pfn < range.end) {
+      auto end = std::min(range.end, section_end(pfn));
+      auto section = pfn_to_section(pfn);
+      if (section != nullptr && section->valid())
+        early_free_range(pfn, end, range.nid);
+      pfn = end;
     }
+  }
+}
+
+void PageAllocator::InitDeferred() {
+  // Prefer sections on our own node so the struct pages and free lists are
+  // written locally, then help out nodes which are still going (or have no
+  // cores of their own)
+  pfn_t start, end;
+  auto nid = my_node();
+  auto found = mem_map_init_deferred(nid, start, end);
+  for (unsigned i = 0; !found && i < numa_nodes.size(); ++i) {
+    nid = nid_t(i);
+    found = mem_map_init_deferred(nid, start, end);
+  }
+  if (!found)
+    return;
+
+  for (size_t i = 0; i < num_free_ranges; ++i) {
+    const auto &range = free_ranges[i];
+    if (range.end <= start || range.start >= end)
+      continue;
+    // other cores may already be allocating from this node
+    std::lock_guard<spinlock> lock(allocators[range.nid].lock_);
+    early_free_range(std::max(range.start, start), std::min(range.end, end),
+                     range.nid);
+  }
+
+  // one section per event so the core still gets to do other work
+  event_manager->SpawnLocal(InitDeferred);
+}
+
+void PageAllocator::early_free_range(pfn_t start, pfn_t end, nid_t nid) {
+  for_each_block(start, end, [nid](pfn_t pfn, size_t order) {
+    early_free_page(pfn, order, nid);
   });
 }
 
@@ -67,7 +175,15 @@ PageAllocator::PageAllocator(nid_t nid) : nid_(nid) {}
 
 pfn_t PageAllocator::AllocLocal(size_t order) {
   std::lock_guard<spinlock> lock(lock_);
+  auto pfn = AllocFromLists(order);
+  if (pfn == NO_PFN && !zeroed_pages_.empty()) {
+    ReleaseZeroed();
+    pfn = AllocFromLists(order);
+  }
+  return pfn;
+}
 
+pfn_t PageAllocator::AllocFromLists(size_t order) {
   free_page *fp = nullptr;
   auto this_order = order;
   while (this_order <= MAX_ORDER) {
@@ -103,6 +219,144 @@ pfn_t PageAllocator::Alloc(size_t order, nid_t nid) {
   }
 }
 
+pfn_t PageAllocator::AllocContig(size_t npages, nid_t nid) {
+  if (nid == nid_) {
+    return AllocContigLocal(npages);
+  } else {
+    return allocators[(size_t)nid].AllocContigLocal(npages);
+  }
+}
+
+pfn_t PageAllocator::AllocContigLocal(size_t npages) {
+  kassert(npages != 0);
+  const size_t block_pages = 1 << MAX_ORDER;
+  if (npages <= block_pages) {
+    size_t order = 0;
+    while ((size_t(1) << order) < npages)
+      ++order;
+    auto pfn = AllocLocal(order);
+    if (pfn == NO_PFN || npages == (size_t(1) << order))
+      return pfn;
+
+    std::lock_guard<spinlock> lock(lock_);
+    for_each_block(pfn + npages, pfn + (1 << order),
+                   [this](pfn_t pfn, size_t order) {
+      FreePageNoCoalesce(pfn, order);
+    });
+    mark_contig_in_use(pfn, pfn + npages);
+    return pfn;
+  }
+
+  // Free runs longer than a block are always made up of free MAX_ORDER
+  // blocks, so look for one followed by enough free neighbours
+  auto nblocks = align_up(npages, block_pages) / block_pages;
+  std::lock_guard<spinlock> lock(lock_);
+  auto &list = free_page_lists[MAX_ORDER];
+  for (auto &fp : list) {
+    auto start = fp.pfn();
+    size_t i = 1;
+    for (; i < nblocks; ++i) {
+      auto page = pfn_to_page(start + i * block_pages);
+      if (page == nullptr || page->nid != nid_ ||
+          page->usage != page::Usage::PAGE_ALLOCATOR ||
+          page->data.order != MAX_ORDER)
+        break;
+    }
+    if (i != nblocks)
+      continue;
+
+    for (i = 0; i < nblocks; ++i) {
+      auto pfn = start + i * block_pages;
+      auto entry = reinterpret_cast<free_page *>(pfn_to_addr(pfn));
+      list.erase(list.iterator_to(*entry));
+    }
+    // hand back what we don't need of the last block
+    auto end = start + nblocks * block_pages;
+    if (start + npages != end) {
+      for_each_block(start + npages, end, [this](pfn_t pfn, size_t order) {
+        FreePageNoCoalesce(pfn, order);
+      });
+    }
+    mark_contig_in_use(start, start + npages);
+    return start;
+  }
+
+  return NO_PFN;
+}
+
+void PageAllocator::FreeContig(pfn_t pfn, size_t npages) {
+  // the same blocks mark_contig_in_use marked when the run was handed out
+  for_each_block(pfn, pfn + npages, [](pfn_t pfn, size_t order) {
+    auto page = pfn_to_page(pfn);
+    kassert(page != nullptr && page->usage == page::Usage::IN_USE);
+    allocators[page->nid].Free(pfn, order);
+  });
+}
+
+pfn_t PageAllocator::AllocZeroed(size_t order, nid_t nid) {
+  auto &allocator = nid == nid_ ? *this : allocators[(size_t)nid];
+  if (order == 0) {
+    std::lock_guard<spinlock> lock(allocator.lock_);
+    auto &list = allocator.zeroed_pages_;
+    if (!list.empty()) {
+      auto &fp = list.front();
+      list.pop_front();
+      auto pfn = fp.pfn();
+      // the list hook was the only thing written to the page
+      std::memset(static_cast<void *>(&fp), 0, sizeof(fp));
+      return pfn;
+    }
+  }
+
+  auto pfn = allocator.AllocLocal(order);
+  if (pfn != NO_PFN)
+    std::memset(reinterpret_cast<void *>(pfn_to_addr(pfn)), 0,
+                PAGE_SIZE << order);
+  return pfn;
+}
+
+bool PageAllocator::RefillZeroed() {
+  pfn_t pfn;
+  {
+    std::lock_guard<spinlock> lock(lock_);
+    if (zeroed_pages_.size() >= ZEROED_POOL_PAGES)
+      return false;
+    // not AllocLocal, which would empty the pool to fill it
+    pfn = AllocFromLists(0);
+  }
+  if (pfn == NO_PFN)
+    return false;
+  auto addr = reinterpret_cast<void *>(pfn_to_addr(pfn));
+  zero_page_nontemporal(addr);
+
+  std::lock_guard<spinlock> lock(lock_);
+  auto entry = new (addr) free_page();
+  zeroed_pages_.push_front(*entry);
+  return true;
+}
+
+PageAllocator::stats PageAllocator::Stats() {
+  stats ret;
+  std::lock_guard<spinlock> lock(lock_);
+  for (size_t i = 0; i <= MAX_ORDER; ++i)
+    ret.free_blocks[i] = free_page_lists[i].size();
+  ret.zeroed_pages = zeroed_pages_.size();
+  return ret;
+}
+
+void PageAllocator::PrintStats() {
+  for (auto &allocator : allocators) {
+    auto stats = allocator.Stats();
+    size_t free_pages = stats.zeroed_pages;
+    kprintf("node %u free blocks by order:", (unsigned)allocator.nid_);
+    for (size_t i = 0; i <= MAX_ORDER; ++i) {
+      kprintf(" %zu", stats.free_blocks[i]);
+      free_pages += stats.free_blocks[i] << i;
+    }
+    kprintf(", %zu zeroed, %zu pages free\n", stats.zeroed_pages, free_pages);
+  }
+}
+
 void PageAllocator::FreePageNoCoalesce(pfn_t pfn, size_t order) {
   auto entry = pfn_to_free_page(pfn);
   free_page_lists[order].push_front(*entry);
@@ -114,6 +368,10 @@ void PageAllocator::FreePageNoCoalesce(pfn_t pfn, size_t order) {
 
 void PageAllocator::Free(pfn_t pfn, size_t order) {
   std::lock_guard<spinlock> lock(lock_);
+  FreePageCoalesce(pfn, order);
+}
+
+void PageAllocator::FreePageCoalesce(pfn_t pfn, size_t order) {
   kassert(order <= MAX_ORDER);
   while (order < MAX_ORDER) {
     auto buddy = pfn_to_buddy(pfn, order);
@@ -130,3 +388,11 @@ void PageAllocator::Free(pfn_t pfn, size_t order) {
   }
   FreePageNoCoalesce(pfn, order);
 }
+
+void PageAllocator::ReleaseZeroed() {
+  while (!zeroed_pages_.empty()) {
+    auto &fp = zeroed_pages_.front();
+    zeroed_pages_.pop_front();
+    FreePageCoalesce(fp.pfn(), 0);
+  }
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <array>
+
 #include <boost/intrusive/list.hpp>
 
 #include <sys/cache_aligned.hpp>
@@ -14,6 +16,7 @@ namespace ebbrt {
 class PageAllocator : public cache_aligned {
 public:
   static const constexpr size_t MAX_ORDER = 11;
+  static const constexpr size_t ZEROED_POOL_PAGES = 512;
 private:
   static_assert(sizeof(uint8_t) * 8 < MAX_ORDER,
                 "page.order is not large enough to hold MAX_ORDER");
@@ -42,23 +45,52 @@ private:
                      &free_page::member_hook> > free_page_list;
 
   std::array<free_page_list, MAX_ORDER + 1> free_page_lists;
+  // order 0 pages zeroed ahead of time by idle cores, see RefillZeroed. They
+  // go back to the free lists before an allocation would fail.
+  free_page_list zeroed_pages_;
   friend void ebbrt::vmem_ap_init(size_t index);
   friend void ebbrt::trans_ap_init(size_t index);
   static boost::container::static_vector<PageAllocator, MAX_NUMA_NODES>
   allocators;
 
   static void early_free_page(pfn_t start, size_t order, nid_t nid);
+  static void early_free_range(pfn_t start, pfn_t end, nid_t nid);
   pfn_t AllocLocal(size_t order);
+  pfn_t AllocContigLocal(size_t npages);
+  // These expect lock_ to be held
+  pfn_t AllocFromLists(size_t order);
+  void FreePageCoalesce(pfn_t pfn, size_t order);
   void FreePageNoCoalesce(pfn_t pfn, size_t order);
+  void ReleaseZeroed();
 
 public:
   static void Init();
+  // Run on every core once SMP is up to bring in the memory Init skipped
+  static void InitDeferred();
   static PageAllocator& HandleFault(EbbId id);
 
   PageAllocator(nid_t nid);
 
   pfn_t Alloc(size_t order = 0, nid_t nid = my_node());
   void Free(pfn_t pfn, size_t order = 0);
+  // Physically contiguous runs of any length, possibly spanning several
+  // MAX_ORDER blocks. Must be freed with FreeContig and the same length.
+  pfn_t AllocContig(size_t npages, nid_t nid = my_node());
+  void FreeContig(pfn_t pfn, size_t npages);
+  // Like Alloc but the memory is zeroed. Single pages usually come from the
+  // pre-zeroed pool, larger allocations are zeroed on the spot.
+  pfn_t AllocZeroed(size_t order = 0, nid_t nid = my_node());
+  // Zero one page into this node's pool, returns false once the pool is full.
+  // Meant to be registered as an idle handler on each core.
+  bool RefillZeroed();
+
+  struct stats {
+    std::array<size_t, MAX_ORDER + 1> free_blocks;
+    size_t zeroed_pages;
+  };
+  // Only holds the node's lock long enough to read the list lengths
+  stats Stats();
+  static void PrintStats();
 };
 
 constexpr auto page_allocator = EbbRef<PageAllocator>{ page_allocator_id };
@@ -232,7 +232,11 @@ pci_bar::pci_bar(pci_device& dev, uint32_t bar_val, uint8_t idx)
 }
 
 pci_bar::~pci_bar() {
-  kbugon(vaddr_ != nullptr, "pci_bar: Need to free mapped region\n");
+  if (vaddr_ == nullptr)
+    return;
+
+  auto npages = align_up(size_, PAGE_SIZE) >> PAGE_SHIFT;
+  vmem_allocator->Free(pfn_down(vaddr_), npages);
 }
 
 bool pci_bar::is_64() const { return is_64_; }
@@ -428,7 +432,8 @@ void pci_device::msix_unmask_entry(size_t idx) {
 void pci_device::set_msix_entry(size_t entry, uint8_t vector, uint8_t dest) {
   auto& msix_bar = get_bar(msix_bar_idx_);
   auto offset = msix_table_offset_ + entry * MSIX_TABLE_ENTRY_SIZE;
-  msix_bar.write32(offset + MSIX_TABLE_ENTRY_ADDR, 0xFEE00000);
+  msix_bar.write32(offset + MSIX_TABLE_ENTRY_ADDR,
+                   0xFEE00000 | uint32_t(dest) << 12);
   msix_bar.write32(offset + MSIX_TABLE_ENTRY_DATA, vector);
   msix_unmask_entry(entry);
 }
@@ -172,6 +172,8 @@ public:
   bool msix_enable();
   void msix_mask_entry(size_t idx);
   void msix_unmask_entry(size_t idx);
+  size_t msix_table_size() const { return msix_table_size_; }
+  // dest is the APIC id of the core to interrupt
   void set_msix_entry(size_t entry, uint8_t vector, uint8_t dest);
 };
 
@@ -3,6 +3,7 @@
 #include <sys/debug.hpp>
 #include <sys/ebb_allocator.hpp>
 #include <sys/explicitly_constructed.hpp>
+#include <sys/heap_profiler.hpp>
 #include <sys/local_id_map.hpp>
 #include <sys/slab_allocator.hpp>
 #include <sys/page_allocator.hpp>
@@ -64,6 +65,24 @@ slab_node_allocator_node_allocators;
 boost::container::static_vector<SlabAllocator, MAX_NUM_CPUS>
 slab_node_allocator_cpu_allocators;
 
+// only ever written by their owner, see slab_cache_stats
+void stat_add(std::atomic<size_t> &stat, size_t n) {
+  stat.store(stat.load(std::memory_order_relaxed) + n,
+             std::memory_order_relaxed);
+}
+
+void stat_sub(std::atomic<size_t> &stat, size_t n) {
+  stat.store(stat.load(std::memory_order_relaxed) - n,
+             std::memory_order_relaxed);
+}
+
+size_t stat_get(const std::atomic<size_t> &stat) {
+  return stat.load(std::memory_order_relaxed);
+}
+
+spinlock slab_roots_lock;
+SlabAllocatorRoot *slab_roots;
+
 explicitly_constructed<SlabAllocatorRoot> slab_cpu_allocator;
 boost::container::static_vector<SlabAllocatorNode, MAX_NUMA_NODES>
 slab_cpu_allocator_node_allocators;
@@ -111,7 +130,7 @@ void ebbrt::slab_init() {
 }
 
 SlabCache::SlabCache(SlabAllocatorRoot &root)
-    : root_(root), remote_check{ false } {}
+    : next_color_{ 0 }, root_(root), remote_check{ false } {}
 SlabCache::~SlabCache() {
   kassert(object_list_.empty());
   kassert(remote_.list.empty());
@@ -127,6 +146,7 @@ retry:
   if (!object_list_.empty()) {
     auto &ret = object_list_.front();
     object_list_.pop_front();
+    stat_sub(stats.cached_objects, 1);
     return ret.addr();
   }
 
@@ -135,8 +155,10 @@ retry:
   if (remote_check) {
     ClaimRemoteFreeList();
 
-    while (object_list_.size() > root_.hiwater)
+    while (object_list_.size() > root_.hiwater) {
+      stat_add(stats.hiwater_flushes, 1);
       FlushFreeList(root_.free_batch);
+    }
 
     goto retry;
   }
@@ -149,11 +171,13 @@ retry:
     // if this is the last allocation remove it from the list
     if (page_slab_data.used + 1 == root_.num_objects_per_slab()) {
       partial_page_list_.pop_front();
+      stat_sub(stats.partial_slabs, 1);
     }
 
     kassert(!page_slab_data.list->empty());
 
     ++page_slab_data.used;
+    stat_add(stats.objects_out, 1);
 
     auto &object = page_slab_data.list->front();
     page_slab_data.list->pop_front();
@@ -175,8 +199,9 @@ void SlabCache::AddSlab(pfn_t pfn) {
   page_slab_data.used = 0;
 
   // Initialize free list
-  auto start = pfn_to_addr(pfn);
-  auto end = pfn_to_addr(pfn) + root_.num_objects_per_slab() * root_.size;
+  auto start = pfn_to_addr(pfn) + next_color_ * root_.color_unit;
+  auto end = start + root_.num_objects_per_slab() * root_.size;
+  next_color_ = (next_color_ + 1) % root_.colors;
   for (uintptr_t addr = start; addr < end; addr += root_.size) {
     // add object to per slab free list
     auto object = new (reinterpret_cast<void *>(addr)) free_object();
@@ -184,17 +209,22 @@ void SlabCache::AddSlab(pfn_t pfn) {
 
     auto addr_page = addr_to_page(addr);
     kassert(addr_page != nullptr);
+    addr_page->heap_samples = 0;
     auto &addr_page_slab_data = addr_page->data.slab_data;
     addr_page_slab_data.cache = this;
   }
 
   partial_page_list_.push_front(*page);
+  stat_add(stats.slabs, 1);
+  stat_add(stats.partial_slabs, 1);
 }
 
 void SlabCache::Free(void *p) {
   auto object = new (p) free_object();
   object_list_.push_front(*object);
+  stat_add(stats.cached_objects, 1);
   if (object_list_.size() > root_.hiwater) {
+    stat_add(stats.hiwater_flushes, 1);
     FlushFreeList(root_.free_batch);
   }
 }
@@ -204,6 +234,7 @@ void SlabCache::FlushFreeList(size_t amount) {
   while (!object_list_.empty() && freed < amount) {
     auto &object = object_list_.front();
     object_list_.pop_front();
+    stat_sub(stats.cached_objects, 1);
     auto obj_addr = object.addr();
     auto pfn = addr_to_slab_pfn(obj_addr, root_.order);
     auto page = pfn_to_page(pfn);
@@ -218,18 +249,22 @@ void SlabCache::FlushFreeList(size_t amount) {
       auto object = new (obj_addr) free_object();
       page_slab_data.list->push_front(*object);
       --page_slab_data.used;
+      stat_sub(stats.objects_out, 1);
 
       if (page_slab_data.used == 0) {
         if (root_.num_objects_per_slab() > 1) {
           partial_page_list_.erase(partial_page_list_.iterator_to(*page));
+          stat_sub(stats.partial_slabs, 1);
         }
 
         // free the page
         page_slab_data.member_hook.destruct();
         page_slab_data.list.destruct();
         page_allocator->Free(pfn, root_.order);
+        stat_sub(stats.slabs, 1);
       } else if (page_slab_data.used + 1 == root_.num_objects_per_slab()) {
         partial_page_list_.push_front(*page);
+        stat_add(stats.partial_slabs, 1);
       }
     }
 
@@ -241,6 +276,8 @@ void SlabCache::FlushFreeListAll() { FlushFreeList(size_t(-1)); }
 
 void SlabCache::ClaimRemoteFreeList() {
   std::lock_guard<spinlock> lock{ remote_.lock };
+  stat_add(stats.cached_objects, remote_.list.size());
+  remote_check = false;
 
   if (object_list_.empty()) {
     object_list_.swap(remote_.list);
@@ -298,8 +335,9 @@ void SlabAllocator::operator delete(void *p) {
 }
 
 void *SlabAllocator::Alloc(nid_t nid) {
+  void *ret;
   if (nid == my_node()) {
-    auto ret = cache_.Alloc();
+    ret = cache_.Alloc();
     if (ret == nullptr) {
       auto pfn = page_allocator->Alloc(cache_.root_.order, nid);
       if (pfn == NO_PFN)
@@ -308,16 +346,21 @@ void *SlabAllocator::Alloc(nid_t nid) {
       ret = cache_.Alloc();
       kassert(ret != nullptr);
     }
-    return ret;
+  } else {
+    auto &node_allocator = cache_.root_.get_node_allocator(nid);
+    ret = node_allocator.Alloc();
+    if (ret == nullptr)
+      return nullptr;
   }
 
-  auto &node_allocator = cache_.root_.get_node_allocator(nid);
-  return node_allocator.Alloc();
+  heap_profile_alloc(ret, cache_.root_.size);
+  return ret;
 }
 
 void SlabAllocator::Free(void *p) {
   auto page = addr_to_page(p);
   kassert(page != nullptr);
+  heap_profile_free(p, *page);
 
   auto nid = page->nid;
   if (nid == my_node()) {
@@ -339,6 +382,7 @@ void SlabAllocator::FreeRemote(void *p) {
 
   auto object = new (p) free_object;
   remote_list_.push_front(*object);
+  stat_add(cache_.stats.remote_batched, 1);
 
   if (remote_list_.size() > cache_.root_.free_batch) {
     FlushRemoteList();
@@ -352,6 +396,9 @@ void SlabAllocator::FlushRemoteList() {
   std::lock_guard<spinlock> lock(remote_cache_->remote_.lock);
   auto &list = remote_cache_->remote_.list;
   auto size = list.size();
+  remote_cache_->stats.remote_frees.fetch_add(remote_list_.size(),
+                                              std::memory_order_relaxed);
+  stat_sub(cache_.stats.remote_batched, remote_list_.size());
   if (list.empty()) {
     list.swap(remote_list_);
   } else {
@@ -409,12 +456,25 @@ SlabAllocatorRoot::SlabAllocatorRoot(size_t size_in, size_t align_in)
     : align{ align_up(std::max(align_in, sizeof(void *)), sizeof(void *)) },
       size{ align_up(std::max(size_in, sizeof(void *)), align) },
       order{ calculate_order(size) }, free_batch{ calculate_freebatch(size) },
-      hiwater{ free_batch * 4 } {
+      hiwater{ free_batch * 4 }, color_unit{ std::max(align, cache_size) },
+      colors{ ((PAGE_SIZE << order) % size) / color_unit + 1 } {
   std::fill(node_allocators.begin(), node_allocators.end(), nullptr);
   std::fill(cpu_allocators.begin(), cpu_allocators.end(), nullptr);
+
+  std::lock_guard<spinlock> lock(slab_roots_lock);
+  next_root = slab_roots;
+  slab_roots = this;
 }
 
 SlabAllocatorRoot::~SlabAllocatorRoot() {
+  {
+    std::lock_guard<spinlock> lock(slab_roots_lock);
+    auto root = &slab_roots;
+    while (*root != this)
+      root = &(*root)->next_root;
+    *root = next_root;
+  }
+
   for (auto &cpu_allocator : cpu_allocators) {
     auto allocator = cpu_allocator.get();
     if (allocator != nullptr) {
@@ -484,3 +544,51 @@ SlabAllocatorNode &SlabAllocatorRoot::get_node_allocator(nid_t nid) {
   }
   return *allocator;
 }
+
+namespace {
+void add_cache_stats(slab_stats &stats, SlabCache &cache) {
+  stats.slabs += stat_get(cache.stats.slabs);
+  stats.partial_slabs += stat_get(cache.stats.partial_slabs);
+  stats.objects_in_use += stat_get(cache.stats.objects_out);
+  stats.cached_objects += stat_get(cache.stats.cached_objects);
+  stats.remote_objects += stat_get(cache.stats.remote_batched);
+  stats.remote_frees += stat_get(cache.stats.remote_frees);
+  stats.hiwater_flushes += stat_get(cache.stats.hiwater_flushes);
+
+  std::lock_guard<spinlock> lock(cache.remote_.lock);
+  stats.remote_objects += cache.remote_.list.size();
+}
+}
+
+slab_stats SlabAllocatorRoot::stats() {
+  slab_stats ret = slab_stats();
+  for (auto &cpu_allocator : cpu_allocators) {
+    auto allocator = cpu_allocator.get();
+    if (allocator != nullptr)
+      add_cache_stats(ret, allocator->cache_);
+  }
+  for (auto &node_allocator : node_allocators) {
+    auto allocator = node_allocator.load();
+    if (allocator != nullptr)
+      add_cache_stats(ret, allocator->cache_);
+  }
+  // objects are counted out of their slab until they reach its free list
+  // again. The counters are read without stopping their owners, so clamp
+  // rather than underflow on a torn snapshot.
+  auto free = ret.cached_objects + ret.remote_objects;
+  ret.objects_in_use =
+      ret.objects_in_use > free ? ret.objects_in_use - free : 0;
+  return ret;
+}
+
+void ebbrt::slab_print_stats() {
+  std::lock_guard<spinlock> lock(slab_roots_lock);
+  for (auto root = slab_roots; root != nullptr; root = root->next_root) {
+    auto stats = root->stats();
+    kprintf("slab %zu bytes (order %zu): %zu slabs, %zu partial, %zu in use, "
+            "%zu cached, %zu remote, %zu remote frees, %zu hiwater flushes\n",
+            root->size, root->order, stats.slabs, stats.partial_slabs,
+            stats.objects_in_use, stats.cached_objects, stats.remote_objects,
+            stats.remote_frees, stats.hiwater_flushes);
+  }
+}
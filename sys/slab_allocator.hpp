@@ -19,9 +19,42 @@
 namespace ebbrt {
 
 void slab_init();
+// Print the stats of every SlabAllocatorRoot
+void slab_print_stats();
 
 struct SlabAllocatorRoot;
 
+// Counters kept by a SlabCache. Each is written only by the owner of the
+// cache (remote_frees under remote_.lock) so they may be read from any core
+// without stopping it. Totals are cumulative, sample twice for a rate.
+struct slab_cache_stats {
+  std::atomic<size_t> slabs;
+  std::atomic<size_t> partial_slabs;
+  // objects taken out of slabs, including those since freed to a free list
+  // that has not given them back yet
+  std::atomic<size_t> objects_out;
+  std::atomic<size_t> cached_objects;
+  // freed objects held back to be handed to another cache in a batch
+  std::atomic<size_t> remote_batched;
+  std::atomic<size_t> remote_frees;
+  std::atomic<size_t> hiwater_flushes;
+
+  slab_cache_stats()
+      : slabs{ 0 }, partial_slabs{ 0 }, objects_out{ 0 }, cached_objects{ 0 },
+        remote_batched{ 0 }, remote_frees{ 0 }, hiwater_flushes{ 0 } {}
+};
+
+// A snapshot of a SlabAllocatorRoot summed over all of its caches
+struct slab_stats {
+  size_t slabs;
+  size_t partial_slabs;
+  size_t objects_in_use;
+  size_t cached_objects;
+  size_t remote_objects;
+  size_t remote_frees;
+  size_t hiwater_flushes;
+};
+
 class SlabCache {
 public:
   struct remote : public cache_aligned {
@@ -73,10 +106,13 @@ private:
 
   free_object_list object_list_;
   page_list partial_page_list_;
+  // color of the next slab, see SlabAllocatorRoot::colors
+  size_t next_color_;
 
 public:
   SlabAllocatorRoot &root_;
   std::atomic<bool> remote_check;
+  slab_cache_stats stats;
 
   SlabCache(SlabAllocatorRoot &root);
   ~SlabCache();
@@ -133,10 +169,18 @@ struct SlabAllocatorRoot {
   size_t order;
   size_t free_batch;
   size_t hiwater;
+  // Successive slabs start their objects at successive multiples of
+  // color_unit, spending the space left over at the end of the slab, so
+  // objects from different slabs don't all land in the same cache sets
+  size_t color_unit;
+  size_t colors;
 
   // TODO: atomic_unique_ptr?
   std::array<std::atomic<SlabAllocatorNode *>, MAX_NUMA_NODES> node_allocators;
   std::array<std::unique_ptr<SlabAllocator>, MAX_NUM_CPUS> cpu_allocators;
+  // all live roots are chained together for slab_print_stats
+  SlabAllocatorRoot *next_root;
+
   SlabAllocatorRoot(size_t size, size_t align = 0);
   ~SlabAllocatorRoot();
 
@@ -145,6 +189,7 @@ struct SlabAllocatorRoot {
   size_t num_objects_per_slab();
   SlabAllocator &get_cpu_allocator(size_t cpu_index = my_cpu());
   SlabAllocatorNode &get_node_allocator(nid_t nid);
+  slab_stats stats();
 };
 
 const constexpr size_t MAX_SLAB_SIZE =
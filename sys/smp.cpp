@@ -5,6 +5,7 @@
 #include <sys/event_manager.hpp>
 #include <sys/page_allocator.hpp>
 #include <sys/smp.hpp>
+#include <sys/tlb.hpp>
 #include <sys/tls.hpp>
 #include <sys/vmem.hpp>
 
@@ -34,7 +35,6 @@ void ebbrt::smp_init() {
   map_memory(pfn_down(SMP_START_ADDRESS), pfn_down(SMP_START_ADDRESS));
   smp_stack_free = stack_list;
   std::copy(smpboot, smpboot_end, reinterpret_cast<char *>(SMP_START_ADDRESS));
-  // TODO: unmap memory
 
   for (size_t i = 1; i < cpus.size(); ++i) {
     auto apic_id = cpus[i].get_apic_id();
@@ -43,6 +43,14 @@ void ebbrt::smp_init() {
     apic_ipi(apic_id, SMP_START_ADDRESS >> 12, 1, DELIVERY_STARTUP);
   }
   smp_barrier->wait();
+
+  // every AP is past the trampoline, unmap it
+  tlb_shootdown shootdown(true);
+  shootdown.add_range(pfn_down(SMP_START_ADDRESS), 1);
+  shootdown.add_cores(cpumask().set());
+  shootdown.flush();
+
+  event_manager->SpawnLocal(PageAllocator::InitDeferred);
 }
 
 extern "C" __attribute__((noreturn)) void ebbrt::smp_main() {
@@ -60,7 +68,13 @@ extern "C" __attribute__((noreturn)) void ebbrt::smp_main() {
   clock_ap_init();
 
   cpu_it->init();
+  tlb_init();
 
-  event_manager->SpawnLocal([]() { smp_barrier->wait(); });
+  event_manager->AddIdleHandler(
+      []() { return page_allocator->RefillZeroed(); });
+  event_manager->SpawnLocal([]() {
+    smp_barrier->wait();
+    PageAllocator::InitDeferred();
+  });
   event_manager->StartProcessingEvents();
 }
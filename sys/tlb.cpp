@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include <sys/apic.hpp>
+#include <sys/cache_aligned.hpp>
+#include <sys/debug.hpp>
+#include <sys/event_manager.hpp>
+#include <sys/spinlock.hpp>
+#include <sys/tlb.hpp>
+#include <sys/vmem.hpp>
+
+using namespace ebbrt;
+
+namespace {
+struct tlb_request {
+  bool unmap;
+  bool flush_all;
+  std::vector<std::pair<pfn_t, size_t> > ranges;
+  std::atomic<size_t> pending;
+  std::function<void()> done;
+};
+
+struct tlb_queue : cache_aligned {
+  spinlock lock;
+  std::vector<std::shared_ptr<tlb_request> > requests;
+};
+
+std::array<tlb_queue, MAX_NUM_CPUS> queues;
+
+void invalidate(const tlb_request &request) {
+  for (const auto &range : request.ranges) {
+    auto addr = pfn_to_addr(range.first);
+    auto length = range.second << PAGE_SHIFT;
+    if (request.unmap)
+      unmap_memory(range.first, length);
+
+    if (!request.flush_all) {
+      for (uintptr_t a = addr; a < addr + length; a += PAGE_SIZE)
+        invlpg(a);
+    }
+  }
+  if (request.flush_all)
+    flush_tlb();
+}
+
+void complete(tlb_request &request) {
+  if (request.pending.fetch_sub(1, std::memory_order_acq_rel) == 1 &&
+      request.done) {
+    request.done();
+  }
+}
+
+void process_requests() {
+  std::vector<std::shared_ptr<tlb_request> > requests;
+  {
+    auto &queue = queues[my_cpu()];
+    std::lock_guard<spinlock> lock{ queue.lock };
+    requests.swap(queue.requests);
+  }
+  for (auto &request : requests) {
+    invalidate(*request);
+    complete(*request);
+  }
+}
+}
+
+void ebbrt::tlb_init() {
+  event_manager->InstallVector(TLB_SHOOTDOWN_VECTOR, process_requests);
+}
+
+void tlb_shootdown::add_range(pfn_t vfn, size_t npages) {
+  ranges_.emplace_back(vfn, npages);
+}
+
+void tlb_shootdown::flush(std::function<void()> done) {
+  auto request = std::make_shared<tlb_request>();
+  request->unmap = unmap_;
+  request->done = std::move(done);
+
+  // coalesce overlapping and adjacent ranges
+  std::sort(ranges_.begin(), ranges_.end());
+  size_t total = 0;
+  for (const auto &range : ranges_) {
+    if (!request->ranges.empty()) {
+      auto &last = request->ranges.back();
+      auto last_end = last.first + last.second;
+      if (range.first <= last_end) {
+        auto end = std::max(last_end, range.first + range.second);
+        total += end - last_end;
+        last.second = end - last.first;
+        continue;
+      }
+    }
+    request->ranges.push_back(range);
+    total += range.second;
+  }
+  ranges_.clear();
+  request->flush_all = total > FLUSH_ALL_THRESHOLD;
+
+  size_t self = my_cpu();
+  auto local = cores_[self];
+  cores_.reset(self);
+
+  size_t remote = 0;
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    if (cores_[i])
+      ++remote;
+  }
+  // count ourselves so done cannot run before every IPI has been sent
+  request->pending.store(remote + 1, std::memory_order_relaxed);
+
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    if (!cores_[i])
+      continue;
+    {
+      std::lock_guard<spinlock> lock{ queues[i].lock };
+      queues[i].requests.push_back(request);
+    }
+    apic_ipi(cpus[i].get_apic_id(), TLB_SHOOTDOWN_VECTOR);
+  }
+  cores_.reset();
+
+  if (local)
+    invalidate(*request);
+  complete(*request);
+}
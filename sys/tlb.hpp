@@ -0,0 +1,49 @@
+#pragma once
+
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include <sys/cpu.hpp>
+#include <sys/pfn.hpp>
+
+namespace ebbrt {
+void tlb_init();
+
+inline void invlpg(uintptr_t addr) {
+  asm volatile("invlpg (%[addr])" : : [addr] "r"(addr) : "memory");
+}
+
+inline void flush_tlb() {
+  asm volatile("mov %%cr3, %%rax;"
+               "mov %%rax, %%cr3"
+               :
+               :
+               : "rax", "memory");
+}
+
+// A batch of virtual ranges to invalidate on a set of cores. Ranges are
+// coalesced and, above FLUSH_ALL_THRESHOLD pages, each core flushes its
+// whole TLB instead. If unmap is set each core also clears the ranges from
+// the page tables it walks before invalidating. APs only have a private top
+// level, the tables below it are shared.
+class tlb_shootdown {
+  bool unmap_;
+  cpumask cores_;
+  std::vector<std::pair<pfn_t, size_t> > ranges_;
+
+public:
+  static const constexpr size_t FLUSH_ALL_THRESHOLD = 32;
+
+  explicit tlb_shootdown(bool unmap = false) : unmap_{ unmap } {}
+
+  void add_range(pfn_t vfn, size_t npages);
+  void add_core(size_t cpu_index) { cores_.set(cpu_index); }
+  void add_cores(const cpumask &cores) { cores_ |= cores; }
+
+  // Invalidate on this core immediately and IPI the other cores. done is run
+  // once every core has invalidated, on whichever core finished last, at
+  // which point the pages and virtual range may be safely reused.
+  void flush(std::function<void()> done = nullptr);
+};
+}
@@ -46,8 +46,7 @@ void ebbrt::trans_ap_init(size_t index) {
       4,
       [&](pte & entry, uint64_t base_virt, size_t level) {
         kassert(!entry.present());
-        auto page = p_allocator.Alloc(0, nid);
-        std::memset(reinterpret_cast<void *>(pfn_to_addr(page)), 0, PAGE_SIZE);
+        auto page = p_allocator.AllocZeroed(0, nid);
         entry.set(pfn_to_addr(page) + (base_virt - LOCAL_TRANS_VMEM_START),
                   level > 0);
         std::atomic_thread_fence(std::memory_order_release);
@@ -57,9 +56,9 @@ void ebbrt::trans_ap_init(size_t index) {
                      : "memory");
       },
       [&](pte & entry) {
-        auto page = p_allocator.Alloc(0, nid);
+        // a zeroed page is already a table of clear entries
+        auto page = p_allocator.AllocZeroed(0, nid);
         auto page_addr = pfn_to_addr(page);
-        new (reinterpret_cast<void *>(page_addr)) pte[512];
         entry.set_normal(page_addr);
         return true;
       });
@@ -2,10 +2,12 @@
 
 #include <atomic>
 #include <cstdint>
+#include <vector>
 
 #include <sys/align.hpp>
 #include <sys/buffer.hpp>
 #include <sys/debug.hpp>
+#include <sys/dma_pool.hpp>
 #include <sys/fls.hpp>
 #include <sys/page_allocator.hpp>
 #include <sys/pci.hpp>
@@ -34,6 +36,7 @@ template <typename virt_type> class virtio_driver {
 
   static const constexpr int QUEUE_ADDRESS_SHIFT = 12;
 
+  static const constexpr int VIRTIO_RING_F_INDIRECT_DESC = 28;
   static const constexpr int VIRTIO_RING_F_EVENT_IDX = 29;
 
   class vring {
@@ -72,6 +75,7 @@ template <typename virt_type> class virtio_driver {
 
     virtio_driver<virt_type>& driver_;
     size_t idx_;
+    dma_buffer ring_;
     void* addr_;
     desc* desc_;
     avail* avail_;
@@ -82,23 +86,146 @@ template <typename virt_type> class virtio_driver {
     uint16_t free_head_;
     uint16_t free_count_;
     std::unordered_map<uint16_t, const_buffer_list> buf_references_;
+    // caller tokens for chains added by add_readable_segments, indexed by the
+    // head descriptor
+    std::vector<void*> tokens_;
+    // while kicks are held, the avail index when hold_kicks was called
+    uint16_t held_idx_;
+    bool kicks_held_;
+    bool indirect_enabled_;
+    // An indirect table of MAX_INDIRECT descriptors per ring slot
+    dma_buffer indirect_;
+
+    desc* indirect_table(uint16_t head) {
+      return static_cast<desc*>(indirect_.addr) + head * MAX_INDIRECT;
+    }
+
+    bool use_indirect(size_t count) const {
+      return indirect_enabled_ && count > 1 && count <= MAX_INDIRECT;
+    }
+
+    // Takes the descriptors of a chain of count buffers, calling fill on
+    // each buffer's descriptor in order. Returns the head.
+    template <typename F> uint16_t add_chain(size_t count, F&& fill) {
+      auto head = free_head_;
+      desc* descs;
+      if (use_indirect(count)) {
+        // the chain takes a single ring slot and lives in that slot's table
+        descs = indirect_table(head);
+        for (size_t i = 0; i < count; ++i) {
+          descs[i].next = i + 1;
+        }
+        auto& d = desc_[head];
+        d.addr = dma_addr(descs);
+        d.len = sizeof(desc) * count;
+        d.flags = desc::F_INDIRECT;
+        free_head_ = d.next;
+        free_count_ -= 1;
+      } else {
+        descs = desc_;
+        free_count_ -= count;
+      }
+
+      desc* last = nullptr;
+      auto idx = descs == desc_ ? head : 0;
+      for (size_t i = 0; i < count; ++i) {
+        last = &descs[idx];
+        last->flags = desc::F_NEXT;
+        fill(*last);
+        idx = last->next;
+      }
+      last->flags &= ~desc::F_NEXT;
+      if (descs == desc_)
+        free_head_ = idx;
+      return head;
+    }
+
+    // Calls f on each buffer's descriptor of the chain at head, then returns
+    // the chain's ring descriptors to the free list
+    template <typename F> void free_chain(uint16_t head, F&& f) {
+      auto& first = desc_[head];
+      if (first.flags & desc::F_INDIRECT) {
+        auto table = static_cast<desc*>(dma_to_virt(first.addr));
+        for (size_t i = 0; i < first.len / sizeof(desc); ++i) {
+          f(table[i]);
+        }
+        first.next = free_head_;
+        free_head_ = head;
+        free_count_ += 1;
+        return;
+      }
+
+      auto last = head;
+      uint16_t len = 1;
+      f(desc_[last]);
+      while (desc_[last].flags & desc::F_NEXT) {
+        last = desc_[last].next;
+        ++len;
+        f(desc_[last]);
+      }
+      desc_[last].next = free_head_;
+      free_head_ = head;
+      free_count_ += len;
+    }
+
+    // kick if the device asked to be notified of any chain from orig_idx up
+    // to avail_idx
+    void notify(uint16_t orig_idx, uint16_t avail_idx) {
+      //ensure that the index write is seen before we detect if we must
+      //notify the device
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+      auto event_idx = avail_event_->load(std::memory_order_relaxed);
+      if ((uint16_t)(avail_idx - event_idx - 1) <
+          (uint16_t)(avail_idx - orig_idx)) {
+        kick();
+      }
+    }
+
+    void make_available(uint16_t head) {
+      auto avail_idx = avail_->idx.load(std::memory_order_relaxed);
+      auto orig_idx = avail_idx;
+      avail_->ring[avail_idx % qsize_] = head;
+      ++avail_idx;
+
+      std::atomic_thread_fence(std::memory_order_release);
+
+      avail_->idx.store(avail_idx, std::memory_order_relaxed);
+
+      if (!kicks_held_)
+        notify(orig_idx, avail_idx);
+    }
 
    public:
-    vring(virtio_driver<virt_type>& driver, uint16_t qsize, size_t idx)
+    // longest chain placed in an indirect table, longer ones take a ring
+    // descriptor per buffer
+    static const constexpr size_t MAX_INDIRECT = 64;
+
+    struct segment {
+      const void* addr;
+      uint32_t len;
+    };
+
+    // The ring and its indirect tables are allocated on node nid
+    vring(virtio_driver<virt_type>& driver, uint16_t qsize, size_t idx,
+          nid_t nid)
         : driver_(driver),
           idx_(idx),
           qsize_(qsize),
           free_head_(0),
-          free_count_(qsize_) {
+          free_count_(qsize_),
+          tokens_(qsize_, nullptr),
+          held_idx_(0),
+          kicks_held_(false),
+          indirect_enabled_(
+              driver.has_feature(VIRTIO_RING_F_INDIRECT_DESC)),
+          indirect_{ nullptr, 0, 0 } {
       auto sz =
           align_up(sizeof(desc) * qsize + sizeof(uint16_t) * (3 + qsize),
                    4096) +
           align_up(sizeof(uint16_t) * 3 + sizeof(used_elem) * qsize, 4096);
-      auto order = fls(sz - 1) - PAGE_SHIFT + 1;
-      auto page = page_allocator->Alloc(order);
-      kbugon(page == NO_PFN, "virtio: page allocation failed");
-      addr_ = reinterpret_cast<void*>(pfn_to_addr(page));
-      memset(addr_, 0, sz);
+      ring_ = dma_alloc_coherent(sz, nid);
+      addr_ = ring_.addr;
 
       desc_ = static_cast<desc*>(addr_);
       avail_ = static_cast<avail*>(static_cast<void*>(
@@ -117,12 +244,25 @@ template <typename virt_type> class virtio_driver {
         desc_[i].next = i + 1;
 
       desc_[qsize_ - 1].next = 0;
+
+      if (indirect_enabled_)
+        indirect_ =
+            dma_alloc_coherent(sizeof(desc) * MAX_INDIRECT * qsize_, nid);
     }
 
-    void* get_addr() { return addr_; }
+    uint64_t get_dma_addr() { return ring_.dma_addr; }
 
     size_t get_num_free_descriptors() { return free_count_; }
 
+    // Ring descriptors taken by a chain of count buffers
+    size_t chain_descriptors(size_t count) const {
+      return use_indirect(count) ? 1 : count;
+    }
+
+    // The head descriptor of the next chain added, so a caller can keep
+    // per-chain data indexed by it
+    uint16_t next_head() const { return free_head_; }
+
     template <typename Iterator>
     Iterator add_writable_buffers(Iterator begin, Iterator end) {
       if (begin == end)
@@ -136,27 +276,20 @@ template <typename virt_type> class virtio_driver {
         if (buf_list.empty())
           continue;
 
-        if (buf_list.size() > free_count_)
+        if (chain_descriptors(buf_list.size()) > free_count_)
           return it;
 
-        //allocate the free descriptors
-        free_count_ -= buf_list.size();
-        uint16_t last_desc = free_head_;
-        uint16_t head = free_head_;
-        for (auto& buf : buf_list) {
-          //for each buffer in this list, write it to a descriptor
+        //for each buffer in this list, write it to a descriptor
+        auto buf = buf_list.begin();
+        auto head = add_chain(buf_list.size(), [&buf](desc& d) {
           void* addr;
           size_t size;
-          std::tie(addr, size) = buf.release();
-          auto& desc = desc_[free_head_];
-          desc.addr = reinterpret_cast<uint64_t>(addr);
-          desc.len = static_cast<uint32_t>(size);
-          desc.flags |= desc::F_WRITE | desc::F_NEXT;
-          last_desc = free_head_;
-          free_head_ = desc.next;
-        }
-        //make sure the last descriptor is marked as such
-        desc_[last_desc].flags &= ~desc::F_NEXT;
+          std::tie(addr, size) = buf->release();
+          d.addr = dma_addr(addr);
+          d.len = static_cast<uint32_t>(size);
+          d.flags |= desc::F_WRITE;
+          ++buf;
+        });
 
         //add this descriptor chain to the avail ring
         avail_->ring[avail_idx % qsize_] = head;
@@ -187,41 +320,44 @@ template <typename virt_type> class virtio_driver {
     }
 
     void add_readable_buffer(const_buffer_list bufs) {
-      kbugon(free_count_ < bufs.size());
-
-      free_count_ -= bufs.size();
-      uint16_t last_desc = free_head_;
-      uint16_t head = free_head_;
-      for (auto& buf : bufs) {
-        auto addr = buf.addr();
-        auto size = buf.size();
-        auto& desc = desc_[free_head_];
-        desc.addr = reinterpret_cast<uint64_t>(addr);
-        desc.len = size;
-        desc.flags |= desc::F_NEXT;
-        last_desc = free_head_;
-        free_head_ = desc.next;
-      }
-      desc_[last_desc].flags &= ~desc::F_NEXT;
+      kbugon(free_count_ < chain_descriptors(bufs.size()));
 
-      auto avail_idx = avail_->idx.load(std::memory_order_relaxed);
-      auto orig_idx = avail_idx;
-      avail_->ring[avail_idx % qsize_] = head;
-      ++avail_idx;
+      auto buf = bufs.begin();
+      auto head = add_chain(bufs.size(), [&buf](desc& d) {
+        d.addr = dma_addr(buf->addr());
+        d.len = buf->size();
+        ++buf;
+      });
 
-      std::atomic_thread_fence(std::memory_order_release);
-
-      avail_->idx.store(avail_idx, std::memory_order_relaxed);
+      make_available(head);
 
-      std::atomic_thread_fence(std::memory_order_seq_cst);
+      buf_references_.emplace(head, std::move(bufs));
+    }
 
-      auto event_idx = avail_event_->load(std::memory_order_relaxed);
-      if ((uint16_t)(avail_idx - event_idx - 1) <
-          (uint16_t)(avail_idx - orig_idx)) {
-        kick();
-      }
+    // Like add_readable_buffer but nothing is allocated, the caller keeps the
+    // segments alive until clean_used_buffers hands token back. The last
+    // writable segments are for the device to write.
+    void add_segments(const segment* segs, size_t count, size_t writable,
+                      void* token) {
+      kbugon(count == 0 || free_count_ < chain_descriptors(count) ||
+             writable > count);
+
+      size_t i = 0;
+      auto head = add_chain(count, [&](desc& d) {
+        d.addr = dma_addr(segs[i].addr);
+        d.len = segs[i].len;
+        if (i >= count - writable)
+          d.flags |= desc::F_WRITE;
+        ++i;
+      });
+
+      tokens_[head] = token;
+      make_available(head);
+    }
 
-      buf_references_.emplace(head, std::move(bufs));
+    void add_readable_segments(const segment* segs, size_t count,
+                               void* token) {
+      add_segments(segs, count, 0, token);
     }
 
     template <typename F> void process_used_buffers(F&& f) {
@@ -244,30 +380,22 @@ template <typename virt_type> class virtio_driver {
           //otherwise the device did give us another used descriptor chain and
           //we must process it before enabling interrupts again.
         }
-        auto& elem = used_->ring[used_index];
+        auto& elem = used_->ring[used_index % qsize_];
         mutable_buffer_list list;
-        desc* descriptor = &desc_[elem.id];
-        list.emplace_front(reinterpret_cast<void*>(descriptor->addr),
-                           descriptor->len);
-        auto it = list.begin();
-        auto len = 1;
-        while (descriptor->flags & desc::F_NEXT) {
-          ++len;
-          descriptor = &desc_[descriptor->next];
-          it = list.emplace_after(
-              it, reinterpret_cast<void*>(descriptor->addr), descriptor->len);
-        }
-        f(std::move(list), elem.len);
+        auto it = list.before_begin();
         //add the descriptor chain to the free list
-        descriptor->next = free_head_;
-        free_head_ = elem.id;
-        free_count_ += len;
+        free_chain(elem.id, [&list, &it](desc& d) {
+          it = list.emplace_after(it, dma_to_virt(d.addr), d.len);
+        });
+        f(std::move(list), elem.len);
 
         ++used_index;
       }
     }
 
-    void clean_used_buffers() {
+    // f is called with the token of every completed add_readable_segments
+    // chain
+    template <typename F> void clean_used_buffers(F&& f) {
       //future interrupts on this queue are implicitly disabled by our use of
       //the event index. We only get an interrupt when the new index crosses the
       //event index.
@@ -287,23 +415,41 @@ template <typename virt_type> class virtio_driver {
           //otherwise the device did give us another used descriptor chain and
           //we must process it before enabling interrupts again.
         }
-        auto& elem = used_->ring[used_index];
-        buf_references_.erase(elem.id);
-        desc* descriptor = &desc_[elem.id];
-        auto len = 1;
-        while (descriptor->flags & desc::F_NEXT) {
-          ++len;
-          descriptor = &desc_[descriptor->next];
+        auto& elem = used_->ring[used_index % qsize_];
+        auto token = tokens_[elem.id];
+        if (token != nullptr) {
+          tokens_[elem.id] = nullptr;
+          f(token);
+        } else {
+          buf_references_.erase(elem.id);
         }
         //add the descriptor chain to the free list
-        descriptor->next = free_head_;
-        free_head_ = elem.id;
-        free_count_ += len;
+        free_chain(elem.id, [](desc&) {});
 
         ++used_index;
       }
     }
 
+    void clean_used_buffers() {
+      clean_used_buffers([](void*) {});
+    }
+
+    // Chains made available between hold_kicks and release_kicks cost at
+    // most one notification. The device may pick them up earlier.
+    void hold_kicks() {
+      if (kicks_held_)
+        return;
+      kicks_held_ = true;
+      held_idx_ = avail_->idx.load(std::memory_order_relaxed);
+    }
+
+    void release_kicks() {
+      if (!kicks_held_)
+        return;
+      kicks_held_ = false;
+      notify(held_idx_, avail_->idx.load(std::memory_order_relaxed));
+    }
+
     uint16_t size() const { return qsize_; }
 
     void kick() { driver_.kick(idx_); }
@@ -340,9 +486,8 @@ template <typename virt_type> class virtio_driver {
 
   uint16_t get_queue_size() { return config_read16(QUEUE_SIZE); }
 
-  void set_queue_addr(void* addr) {
-    auto addr_val = reinterpret_cast<uintptr_t>(addr);
-    addr_val >>= QUEUE_ADDRESS_SHIFT;
+  void set_queue_addr(uint64_t addr) {
+    auto addr_val = addr >> QUEUE_ADDRESS_SHIFT;
     kassert(addr_val <= std::numeric_limits<uint32_t>::max());
     config_write32(QUEUE_ADDRESS, addr_val);
   }
@@ -357,8 +502,8 @@ template <typename virt_type> class virtio_driver {
       if (qsize == 0)
         return;
 
-      queues_.emplace_back(*this, qsize, idx);
-      set_queue_addr(queues_.back().get_addr());
+      queues_.emplace_back(*this, qsize, idx, virt_type::queue_node(idx));
+      set_queue_addr(queues_.back().get_dma_addr());
       set_queue_vector(idx);
     }
   }
@@ -373,19 +518,23 @@ template <typename virt_type> class virtio_driver {
     auto device_features = get_device_features();
     auto driver_features = virt_type::get_driver_features();
 
-    driver_features |= 1 << VIRTIO_RING_F_EVENT_IDX;
+    driver_features |= 1 << VIRTIO_RING_F_EVENT_IDX |
+                       1 << VIRTIO_RING_F_INDIRECT_DESC;
 
-    auto subset = device_features & driver_features;
+    auto subset =
+        virt_type::filter_features(device_features & driver_features);
 
     kassert(subset & 1 << VIRTIO_RING_F_EVENT_IDX);
 
     set_guest_features(subset);
+    features_ = subset;
   }
 
   pci_device& dev_;
   pci_bar& bar0_;
 
   std::vector<vring> queues_;
+  uint32_t features_;
 
  public:
   static bool probe(pci_device& dev) {
@@ -408,13 +557,29 @@ template <typename virt_type> class virtio_driver {
 
     add_device_status(CONFIG_ACKNOWLEDGE | CONFIG_DRIVER);
 
-    setup_virt_queues();
-
+    // the rings need to know whether indirect descriptors are in use
     setup_features();
+
+    setup_virt_queues();
   }
 
+  // Drivers may hide this to drop features which depend on others the
+  // device did not offer
+  static uint32_t filter_features(uint32_t features) { return features; }
+
+  // Drivers may hide this to place a queue's ring on the node of the core
+  // that services it
+  static nid_t queue_node(size_t index) { return my_node(); }
+
   vring& get_queue(size_t index) { return queues_[index]; }
 
+  size_t num_queues() const { return queues_.size(); }
+
+  pci_device& get_pci_device() { return dev_; }
+
+  // true if the feature was offered by the device and requested by the driver
+  bool has_feature(int bit) const { return features_ & 1 << bit; }
+
   void add_device_status(uint8_t status) {
     auto s = get_device_status();
     s |= status;
@@ -426,5 +591,9 @@ template <typename virt_type> class virtio_driver {
   uint8_t device_config_read8(size_t idx) {
     return config_read8(DEVICE_CONFIGURATION + idx);
   }
+
+  uint16_t device_config_read16(size_t idx) {
+    return config_read16(DEVICE_CONFIGURATION + idx);
+  }
 };
 }
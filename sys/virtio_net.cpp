@@ -1,3 +1,18 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <tuple>
+
+#include <lwip/inet_chksum.h>
+#include <lwip/ip.h>
+#include <lwip/pbuf.h>
+#include <lwip/tcp_impl.h>
+
+#include <sys/clock.hpp>
+#include <sys/cpu.hpp>
 #include <sys/debug.hpp>
 #include <sys/event_manager.hpp>
 #include <sys/virtio_net.hpp>
@@ -5,14 +20,196 @@
 using namespace ebbrt;
 
 namespace {
+const constexpr int VIRTIO_NET_F_CSUM = 0;
+const constexpr int VIRTIO_NET_F_GUEST_CSUM = 1;
+const constexpr int VIRTIO_NET_F_MTU = 3;
 const constexpr int VIRTIO_NET_F_MAC = 5;
+const constexpr int VIRTIO_NET_F_GUEST_TSO4 = 7;
+const constexpr int VIRTIO_NET_F_HOST_TSO4 = 11;
 const constexpr int VIRTIO_NET_F_MRG_RXBUF = 15;
+const constexpr int VIRTIO_NET_F_CTRL_VQ = 17;
+const constexpr int VIRTIO_NET_F_MQ = 22;
+const constexpr size_t MAX_VIRTQUEUE_PAIRS_OFFSET = 8;
+const constexpr size_t MTU_OFFSET = 10;
+const constexpr size_t RX_BUFFER_SIZE = PAGE_SIZE;
+// used when the device doesn't give its MTU
+const constexpr uint16_t DEFAULT_MTU = 1500;
+const constexpr uint16_t MAX_MTU = 9000;
+// longer pbuf chains are flattened into one buffer before sending
+const constexpr size_t MAX_TX_SEGMENTS = 16;
+// segments held for one large frame are sent separately beyond this
+const constexpr size_t MAX_GSO_DESCRIPTORS = 64;
+// frames queued in software while the send ring is full
+const constexpr size_t TX_BACKLOG_HIGH = 1024;
+const constexpr size_t TX_BACKLOG_LOW = 256;
+
+const constexpr uint8_t VIRTIO_NET_CTRL_MQ = 4;
+const constexpr uint8_t VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET = 0;
+const constexpr uint8_t VIRTIO_NET_OK = 0;
+// how long to wait for the device to complete a control command
+const constexpr std::chrono::milliseconds CTRL_TIMEOUT{ 100 };
+
+struct virtio_net_ctrl_mq {
+  uint8_t cls;
+  uint8_t cmd;
+  uint16_t virtqueue_pairs;
+  uint8_t ack;
+} __attribute__((packed));
+
+const constexpr size_t ETH_HLEN = 14;
+const constexpr size_t ETH_TYPE_OFFSET = 12;
+const constexpr uint16_t ETH_TYPE_IP = 0x0800;
+const constexpr uint16_t TCP_CSUM_OFFSET = 16;
+const constexpr uint16_t UDP_CSUM_OFFSET = 6;
+
+// The TCP or UDP checksum of a frame
+struct l4_checksum {
+  struct ip_hdr* iph;
+  // of the TCP or UDP header from the start of the frame
+  uint16_t start;
+  // of the checksum field from start
+  uint16_t offset;
+  // from start to the end of the IP datagram
+  uint16_t len;
+};
+
+// Finds the checksum of an unfragmented IPv4 TCP or UDP frame whose headers
+// are in the first contiguous bytes. Fragments carry no checksum of their
+// own and lwIP leaves it unset on the ones it makes.
+bool find_l4_checksum(char* frame, size_t contiguous, size_t len,
+                      l4_checksum& csum) {
+  if (contiguous < ETH_HLEN + IP_HLEN)
+    return false;
+  uint16_t type;
+  std::memcpy(&type, frame + ETH_TYPE_OFFSET, sizeof(type));
+  if (ntohs(type) != ETH_TYPE_IP)
+    return false;
+
+  auto iph = reinterpret_cast<struct ip_hdr*>(frame + ETH_HLEN);
+  if (ntohs(IPH_OFFSET(iph)) & (IP_MF | IP_OFFMASK))
+    return false;
+  switch (IPH_PROTO(iph)) {
+  case IP_PROTO_TCP:
+    csum.offset = TCP_CSUM_OFFSET;
+    break;
+  case IP_PROTO_UDP:
+    csum.offset = UDP_CSUM_OFFSET;
+    break;
+  default:
+    return false;
+  }
+
+  size_t ihl = IPH_HL(iph) * 4;
+  size_t ip_len = ntohs(IPH_LEN(iph));
+  if (ihl < IP_HLEN || ip_len < ihl + csum.offset + sizeof(uint16_t) ||
+      ETH_HLEN + ip_len > len ||
+      ETH_HLEN + ihl + csum.offset + sizeof(uint16_t) > contiguous)
+    return false;
+
+  csum.iph = iph;
+  csum.start = ETH_HLEN + ihl;
+  csum.len = ip_len - ihl;
+  return true;
+}
+
+uint16_t csum_fold(uint32_t sum) {
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return sum;
+}
+
+// Sum of the pseudo header in the byte order of the checksum fields
+uint32_t pseudo_header_sum(const l4_checksum& csum) {
+  uint16_t addrs[4];
+  std::memcpy(&addrs[0], &csum.iph->src, sizeof(csum.iph->src));
+  std::memcpy(&addrs[2], &csum.iph->dest, sizeof(csum.iph->dest));
+  uint32_t sum = 0;
+  for (auto word : addrs) {
+    sum += word;
+  }
+  sum += htons(IPH_PROTO(csum.iph));
+  sum += htons(csum.len);
+  return sum;
+}
+
+// lwIP builds a TCP segment's headers in its first pbuf
+bool carries_tcp(struct pbuf* p) {
+  l4_checksum csum;
+  return find_l4_checksum(
+             static_cast<char*>(p->payload), p->len, p->tot_len, csum) &&
+         IPH_PROTO(csum.iph) == IP_PROTO_TCP;
+}
+
+// A TCP segment whose headers are in the first contiguous bytes of its
+// frame
+struct tcp_segment {
+  struct ip_hdr* iph;
+  struct tcp_hdr* tcph;
+  // of the Ethernet, IP and TCP headers together
+  uint16_t hdr_len;
+  uint16_t data_len;
+};
+
+bool find_tcp_segment(char* frame, size_t contiguous, size_t len,
+                      tcp_segment& seg) {
+  l4_checksum csum;
+  if (!find_l4_checksum(frame, contiguous, len, csum) ||
+      IPH_PROTO(csum.iph) != IP_PROTO_TCP)
+    return false;
+
+  auto tcph = reinterpret_cast<struct tcp_hdr*>(frame + csum.start);
+  size_t thl = TCPH_HDRLEN(tcph) * 4;
+  if (thl < TCP_HLEN || thl > csum.len || csum.start + thl > contiguous)
+    return false;
+
+  seg.iph = csum.iph;
+  seg.tcph = tcph;
+  seg.hdr_len = csum.start + thl;
+  seg.data_len = csum.len - thl;
+  return true;
+}
+
+// Only plain data segments are sent as part of a larger frame
+bool gso_candidate(const tcp_segment& seg) {
+  return seg.data_len > 0 && (TCPH_FLAGS(seg.tcph) & ~TCP_PSH) == TCP_ACK;
+}
+
+// The device builds every segment's headers from the first one's, so they
+// must not differ beyond the sequence number and PSH
+bool same_headers(const tcp_segment& a, const tcp_segment& b) {
+  return a.hdr_len == b.hdr_len && IPH_HL(a.iph) == IPH_HL(b.iph) &&
+         std::memcmp(&a.iph->src, &b.iph->src, sizeof(a.iph->src)) == 0 &&
+         std::memcmp(&a.iph->dest, &b.iph->dest, sizeof(a.iph->dest)) == 0 &&
+         a.tcph->src == b.tcph->src && a.tcph->dest == b.tcph->dest &&
+         a.tcph->ackno == b.tcph->ackno && a.tcph->wnd == b.tcph->wnd &&
+         std::memcmp(a.tcph + 1,
+                     b.tcph + 1,
+                     TCPH_HDRLEN(a.tcph) * 4 - TCP_HLEN) == 0;
+}
 }
 
 virtio_net_driver::virtio_net_driver(pci_device& dev)
-    : virtio_driver<virtio_net_driver>(dev) {
+    : virtio_driver<virtio_net_driver>(dev),
+      rx_pool_(RX_BUFFER_SIZE, RX_BUFFER_SIZE), num_pairs_(1) {
   std::memset(static_cast<void*>(&empty_header_), 0, sizeof(empty_header_));
 
+  // num_buffers is only there with mergeable receive buffers
+  hdr_size_ = sizeof(virtio_net_hdr);
+  if (!has_feature(VIRTIO_NET_F_MRG_RXBUF))
+    hdr_size_ -= sizeof(empty_header_.num_buffers);
+
+  mtu_ = DEFAULT_MTU;
+  max_mtu_ = MAX_MTU;
+  if (has_feature(VIRTIO_NET_F_MTU)) {
+    mtu_ = max_mtu_ = device_config_read16(MTU_OFFSET);
+  }
+  // Otherwise every receive chain must hold the largest frame
+  rx_chain_len_ = 1;
+  if (!has_feature(VIRTIO_NET_F_MRG_RXBUF)) {
+    rx_chain_len_ =
+        (hdr_size_ + ETH_HLEN + max_mtu_ + RX_BUFFER_SIZE - 1) / RX_BUFFER_SIZE;
+  }
+
   for (int i = 0; i < 6; ++i) {
     mac_addr_[i] = device_config_read8(i);
   }
@@ -25,39 +222,137 @@ virtio_net_driver::virtio_net_driver(pci_device& dev)
           mac_addr_[4],
           mac_addr_[5]);
 
-  fill_rx_ring();
+  size_t max_pairs = 1;
+  if (has_feature(VIRTIO_NET_F_MQ) && has_feature(VIRTIO_NET_F_CTRL_VQ)) {
+    max_pairs = device_config_read16(MAX_VIRTQUEUE_PAIRS_OFFSET);
+    // each queue of a pair needs its own MSI-X entry
+    num_pairs_ = std::min({ max_pairs, size_t(cpus.size()),
+                            dev.msix_table_size() / 2 });
+    kbugon(num_pairs_ == 0 || num_queues() < max_pairs * 2 + 1,
+           "virtio-net: device is missing queues\n");
+  }
+  tx_queues_.resize(num_pairs_);
+  rx_frames_.resize(num_pairs_);
+  for (size_t i = 0; i < num_pairs_; ++i) {
+    tx_queues_[i].chains.resize(get_queue(tx_queue_index(i)).size());
+  }
+
+  setup_queue_pair(0);
 
-  auto rcv_vector = event_manager->AllocateVector([this]() {
-    auto& rcv_queue = get_queue(0);
-    rcv_queue.process_used_buffers([this](mutable_buffer_list list, size_t len) {
-        kassert(list.size() == 1);
-        list.front() += sizeof(virtio_net_hdr);
-        itf_->ReceivePacket(std::move(list.front()), len - sizeof(virtio_net_hdr));
-    });
+  add_device_status(CONFIG_DRIVER_OK);
+
+  itf_ = &network_manager->NewInterface(*this);
+
+  if (num_pairs_ > 1) {
+    // the control queue follows the device's maximum number of pairs
+    if (!set_queue_pairs(max_pairs * 2, num_pairs_)) {
+      kprintf("virtio-net: failed to enable %zu queue pairs\n", num_pairs_);
+      num_pairs_ = 1;
+      return;
+    }
+    kprintf("virtio-net: %zu queue pairs\n", num_pairs_);
+    for (size_t i = 1; i < num_pairs_; ++i) {
+      event_manager->SpawnRemote([this, i]() { setup_queue_pair(i); }, i);
+    }
+  }
+}
+
+// Runs on core pair so the interrupt handlers are registered there
+void virtio_net_driver::setup_queue_pair(size_t pair) {
+  auto& dev = get_pci_device();
+  auto apic_id = cpus[my_cpu()].get_apic_id();
+
+  auto rcv_vector = event_manager->AllocateVector([this, pair]() {
+    auto& rcv_queue = get_queue(rx_queue_index(pair));
+    {
+      // one acquisition covers every frame handed to lwIP, and what it sends
+      // in reply goes out as one batch
+      std::lock_guard<lwip_mutex> lock{ lwip_lock };
+      begin_send_batch();
+      rcv_queue.process_used_buffers([this, pair](mutable_buffer_list list,
+                                                  size_t len) {
+        receive_chain(pair, std::move(list), len);
+      });
+      end_send_batch();
+    }
     if (rcv_queue.get_num_free_descriptors() * 2 >= rcv_queue.size()) {
-      fill_rx_ring();
+      fill_rx_ring(pair);
     }
   });
-  dev.set_msix_entry(0, rcv_vector, 0);
+  dev.set_msix_entry(rx_queue_index(pair), rcv_vector, apic_id);
 
-  auto send_vector = event_manager->AllocateVector([this]() {
-    auto& send_queue = get_queue(1);
-    send_queue.clean_used_buffers();
+  auto send_vector = event_manager->AllocateVector([this, pair]() {
+    // cores without a pair of their own may be sending on this queue, they
+    // do so under lwip_lock
+    std::lock_guard<lwip_mutex> lock{ lwip_lock };
+    auto& send_queue = get_queue(tx_queue_index(pair));
+    send_queue.clean_used_buffers([](void* token) {
+      auto chain = static_cast<tx_chain*>(token);
+      for (auto p : chain->pbufs) {
+        pbuf_free(p);
+      }
+      chain->pbufs.clear();
+    });
+    drain_tx_backlog(pair);
   });
-  dev.set_msix_entry(1, send_vector, 0);
+  dev.set_msix_entry(tx_queue_index(pair), send_vector, apic_id);
 
-  add_device_status(CONFIG_DRIVER_OK);
+  fill_rx_ring(pair);
+}
 
-  itf_ = &network_manager->NewInterface(*this);
+bool virtio_net_driver::set_queue_pairs(size_t ctrl_index, uint16_t pairs) {
+  auto& ctrl_queue = get_queue(ctrl_index);
+
+  // the event stack is not DMA-able, the command must come from the heap
+  auto cmd = static_cast<virtio_net_ctrl_mq*>(
+      std::malloc(sizeof(virtio_net_ctrl_mq)));
+  kbugon(cmd == nullptr, "virtio-net: failed to allocate control command\n");
+  cmd->cls = VIRTIO_NET_CTRL_MQ;
+  cmd->cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+  cmd->virtqueue_pairs = pairs;
+  cmd->ack = ~VIRTIO_NET_OK;
+
+  std::array<vring::segment, 3> segs = { {
+    { &cmd->cls, 2 },
+    { &cmd->virtqueue_pairs, sizeof(cmd->virtqueue_pairs) },
+    { &cmd->ack, sizeof(cmd->ack) }
+  } };
+  ctrl_queue.add_segments(segs.data(), segs.size(), 1, cmd);
+
+  // the control queue has no interrupt, the device completes commands
+  // quickly so wait for it here
+  bool done = false;
+  auto deadline = clock_time() + CTRL_TIMEOUT;
+  while (!done) {
+    ctrl_queue.clean_used_buffers([&done](void*) { done = true; });
+    if (!done && clock_time() > deadline) {
+      // the device still owns cmd, so it is never freed
+      kprintf("virtio-net: control command timed out\n");
+      return false;
+    }
+  }
+
+  auto ok = cmd->ack == VIRTIO_NET_OK;
+  std::free(cmd);
+  return ok;
 }
 
-void virtio_net_driver::fill_rx_ring() {
-  auto& rcv_queue = get_queue(0);
-  auto num_bufs = rcv_queue.get_num_free_descriptors();
-  auto bufs = std::vector<mutable_buffer_list>(num_bufs);
+size_t virtio_net_driver::my_pair() const { return my_cpu() % num_pairs_; }
+
+void virtio_net_driver::fill_rx_ring(size_t pair) {
+  auto& rcv_queue = get_queue(rx_queue_index(pair));
+  auto num_chains = rcv_queue.get_num_free_descriptors() /
+                    rcv_queue.chain_descriptors(rx_chain_len_);
+  auto bufs = std::vector<mutable_buffer_list>(num_chains);
 
   for (auto& buf_list : bufs) {
-    buf_list.emplace_front(2048);
+    for (size_t i = 0; i < rx_chain_len_; ++i) {
+      // the mutable_buffer releases it with free(), which returns it to the
+      // pool
+      auto buf = rx_pool_.alloc();
+      kbugon(buf == nullptr, "virtio: failed to allocate rx buffer\n");
+      buf_list.emplace_front(buf, RX_BUFFER_SIZE);
+    }
   }
 
   auto it = rcv_queue.add_writable_buffers(bufs.begin(), bufs.end());
@@ -65,18 +360,428 @@ void virtio_net_driver::fill_rx_ring() {
 }
 
 uint32_t virtio_net_driver::get_driver_features() {
-  return 1 << VIRTIO_NET_F_MAC | 1 << VIRTIO_NET_F_MRG_RXBUF;
+  return 1 << VIRTIO_NET_F_CSUM | 1 << VIRTIO_NET_F_GUEST_CSUM |
+         1 << VIRTIO_NET_F_MTU | 1 << VIRTIO_NET_F_MAC |
+         1 << VIRTIO_NET_F_GUEST_TSO4 | 1 << VIRTIO_NET_F_HOST_TSO4 |
+         1 << VIRTIO_NET_F_MRG_RXBUF | 1 << VIRTIO_NET_F_CTRL_VQ |
+         1 << VIRTIO_NET_F_MQ;
+}
+
+// Pair i is serviced by core i. Queues past the last core stay on the probing
+// core's node, the control queue is only used while probing so it does not
+// matter where it lands.
+nid_t virtio_net_driver::queue_node(size_t index) {
+  auto core = index / 2;
+  return core < cpus.size() ? cpus[core].get_nid() : my_node();
+}
+
+uint32_t virtio_net_driver::filter_features(uint32_t features) {
+  // the device checksums the segments it cuts, and large frames it receives
+  // are spread over several buffers
+  if (!(features & 1 << VIRTIO_NET_F_CSUM))
+    features &= ~(1 << VIRTIO_NET_F_HOST_TSO4);
+  if (!(features & 1 << VIRTIO_NET_F_GUEST_CSUM) ||
+      !(features & 1 << VIRTIO_NET_F_MRG_RXBUF))
+    features &= ~(1 << VIRTIO_NET_F_GUEST_TSO4);
+  return features;
 }
 
 void virtio_net_driver::send(const_buffer_list bufs) {
-  bufs.emplace_front(static_cast<const void*>(&empty_header_),
-                     sizeof(empty_header_));
+  bufs.emplace_front(static_cast<const void*>(&empty_header_), hdr_size_);
+
+  auto pair = my_pair();
+  flush_gso(pair);
+  auto& send_queue = get_queue(tx_queue_index(pair));
+  if (tx_queues_[pair].backlog.empty() &&
+      send_queue.get_num_free_descriptors() >=
+          send_queue.chain_descriptors(bufs.size())) {
+    send_queue.add_readable_buffer(std::move(bufs));
+    return;
+  }
+
+  // queue a copy, without the header which send_pbuf adds again
+  bufs.pop_front();
+  size_t len = 0;
+  for (const auto& buf : bufs) {
+    len += buf.size();
+  }
+  auto p = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+  kbugon(p == nullptr, "Failed to allocate pbuf\n");
+  auto ptr = static_cast<char*>(p->payload);
+  for (const auto& buf : bufs) {
+    std::memcpy(ptr, buf.addr(), buf.size());
+    ptr += buf.size();
+  }
+  send_pbuf(p);
+  pbuf_free(p);
+}
+
+// Callers hold lwip_lock, which also covers cores that share a queue pair
+bool virtio_net_driver::send_pbuf(struct pbuf* p) {
+  auto pair = my_pair();
+  auto& txq = tx_queues_[pair];
+  if (txq.stopped && !carries_tcp(p))
+    return false;
+
+  if (size_t(pbuf_clen(p)) + 1 > MAX_TX_SEGMENTS) {
+    auto flat = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
+    kbugon(flat == nullptr, "Failed to allocate pbuf\n");
+    pbuf_copy(flat, p);
+    auto ret = send_pbuf(flat);
+    pbuf_free(flat);
+    return ret;
+  }
+
+  auto frame = tx_frame{ p, p->payload, p->len, 0, 0 };
+  if (gso_append(pair, frame))
+    return true;
+
+  prepare_tx_checksum(frame);
+  queue_tx_frame(pair, frame);
+  return true;
+}
+
+void virtio_net_driver::queue_tx_frame(size_t pair, const tx_frame& frame) {
+  auto& txq = tx_queues_[pair];
+  // frames already waiting go first
+  if (txq.backlog.empty() && add_tx_frame(pair, frame))
+    return;
+
+  pbuf_ref(frame.p);
+  txq.backlog.push_back(frame);
+  if (txq.backlog.size() >= TX_BACKLOG_HIGH)
+    txq.stopped = true;
+}
+
+bool virtio_net_driver::add_tx_frame(size_t pair, const tx_frame& frame) {
+  std::array<vring::segment, MAX_TX_SEGMENTS> segs;
+  size_t count = 1;
+  if (frame.len > 0)
+    segs[count++] = { frame.payload, frame.len };
+  for (auto q = frame.p->next; q != nullptr; q = q->next) {
+    if (q->len > 0)
+      segs[count++] = { q->payload, q->len };
+  }
+
+  auto& send_queue = get_queue(tx_queue_index(pair));
+  if (send_queue.get_num_free_descriptors() <
+      send_queue.chain_descriptors(count))
+    return false;
+
+  auto& chain = tx_queues_[pair].chains[send_queue.next_head()];
+  chain.hdr = empty_header_;
+  if (frame.csum_start != 0) {
+    chain.hdr.flags = virtio_net_hdr::VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    chain.hdr.csum_start = frame.csum_start;
+    chain.hdr.csum_offset = frame.csum_offset;
+  }
+  segs[0] = { &chain.hdr, uint32_t(hdr_size_) };
+
+  pbuf_ref(frame.p);
+  chain.pbufs.push_back(frame.p);
+  send_queue.add_readable_segments(segs.data(), count, &chain);
+  return true;
+}
+
+// Holds frame back to go out with the segments of its stream that follow.
+// Returns false if it must be sent on its own, after anything held.
+bool virtio_net_driver::gso_append(size_t pair, const tx_frame& frame) {
+  auto& txq = tx_queues_[pair];
+  if (txq.batch_depth == 0 || !has_feature(VIRTIO_NET_F_HOST_TSO4))
+    return false;
+
+  tcp_segment seg;
+  auto candidate = find_tcp_segment(static_cast<char*>(frame.payload),
+                                    frame.len,
+                                    frame.p->tot_len,
+                                    seg) &&
+                   gso_candidate(seg);
+  auto& frames = txq.gso_frames;
+  auto descriptors = pbuf_clen(frame.p);
+  if (candidate && !frames.empty()) {
+    auto& front = frames.front();
+    tcp_segment first;
+    find_tcp_segment(
+        static_cast<char*>(front.payload), front.len, front.p->tot_len, first);
+    auto ip_len = first.hdr_len - ETH_HLEN + txq.gso_data_len + seg.data_len;
+    if (same_headers(first, seg) &&
+        ntohl(seg.tcph->seqno) == txq.gso_next_seq &&
+        seg.data_len <= txq.gso_size &&
+        ip_len <= std::numeric_limits<uint16_t>::max() &&
+        txq.gso_descriptors + descriptors <= MAX_GSO_DESCRIPTORS) {
+      pbuf_ref(frame.p);
+      frames.push_back(frame);
+      txq.gso_next_seq += seg.data_len;
+      txq.gso_data_len += seg.data_len;
+      txq.gso_descriptors += descriptors;
+      // a short or pushed segment ends the frame
+      if (seg.data_len < txq.gso_size || TCPH_FLAGS(seg.tcph) & TCP_PSH)
+        flush_gso(pair);
+      return true;
+    }
+  }
+
+  flush_gso(pair);
+  if (!candidate || TCPH_FLAGS(seg.tcph) & TCP_PSH || !txq.backlog.empty())
+    return false;
+
+  pbuf_ref(frame.p);
+  frames.push_back(frame);
+  txq.gso_next_seq = ntohl(seg.tcph->seqno) + seg.data_len;
+  txq.gso_size = seg.data_len;
+  txq.gso_data_len = seg.data_len;
+  // and one each for the virtio header and the frame's headers
+  txq.gso_descriptors = 2 + descriptors;
+  return true;
+}
+
+void virtio_net_driver::flush_gso(size_t pair) {
+  auto& txq = tx_queues_[pair];
+  auto& frames = txq.gso_frames;
+  if (frames.empty())
+    return;
+
+  if (frames.size() == 1 || !txq.backlog.empty() || !add_gso_frame(pair)) {
+    for (auto& frame : frames) {
+      prepare_tx_checksum(frame);
+      queue_tx_frame(pair, frame);
+    }
+  }
+  for (auto& frame : frames) {
+    pbuf_free(frame.p);
+  }
+  frames.clear();
+}
+
+// Sends the held segments as one frame, which the device cuts back into
+// segments of gso_size
+bool virtio_net_driver::add_gso_frame(size_t pair) {
+  auto& txq = tx_queues_[pair];
+  auto& frames = txq.gso_frames;
+  auto& send_queue = get_queue(tx_queue_index(pair));
+  if (send_queue.get_num_free_descriptors() <
+      send_queue.chain_descriptors(txq.gso_descriptors))
+    return false;
+
+  auto& front = frames.front();
+  auto& back = frames.back();
+  auto data = static_cast<char*>(front.payload);
+  tcp_segment first, last;
+  find_tcp_segment(data, front.len, front.p->tot_len, first);
+  find_tcp_segment(
+      static_cast<char*>(back.payload), back.len, back.p->tot_len, last);
+
+  // The first segment's headers, copied, stand for all of them. lwIP still
+  // owns its segment and rewrites them if it sends it again.
+  auto& chain = txq.chains[send_queue.next_head()];
+  auto hdrs = chain.gso_hdrs.data();
+  kassert(first.hdr_len <= chain.gso_hdrs.size());
+  std::memcpy(hdrs, data, first.hdr_len);
+  auto iph = reinterpret_cast<struct ip_hdr*>(
+      hdrs + (reinterpret_cast<char*>(first.iph) - data));
+  auto tcph = reinterpret_cast<struct tcp_hdr*>(
+      hdrs + (reinterpret_cast<char*>(first.tcph) - data));
+
+  std::array<vring::segment, MAX_GSO_DESCRIPTORS> segs;
+  size_t count = 1;
+  segs[count++] = { hdrs, first.hdr_len };
+  for (const auto& frame : frames) {
+    if (frame.len > first.hdr_len) {
+      segs[count++] = { static_cast<char*>(frame.payload) + first.hdr_len,
+                        uint32_t(frame.len - first.hdr_len) };
+    }
+    for (auto q = frame.p->next; q != nullptr; q = q->next) {
+      if (q->len > 0)
+        segs[count++] = { q->payload, q->len };
+    }
+  }
+
+  size_t ip_len = first.hdr_len - ETH_HLEN + txq.gso_data_len;
+  IPH_LEN_SET(iph, htons(ip_len));
+  IPH_CHKSUM_SET(iph, 0);
+  IPH_CHKSUM_SET(iph, inet_chksum(iph, IPH_HL(iph) * 4));
+  if (TCPH_FLAGS(last.tcph) & TCP_PSH)
+    TCPH_SET_FLAG(tcph, TCP_PSH);
+
+  l4_checksum csum;
+  find_l4_checksum(hdrs, first.hdr_len, ETH_HLEN + ip_len, csum);
+  auto field = reinterpret_cast<uint16_t*>(hdrs + csum.start + csum.offset);
+  *field = csum_fold(pseudo_header_sum(csum));
+
+  chain.hdr = empty_header_;
+  chain.hdr.flags = virtio_net_hdr::VIRTIO_NET_HDR_F_NEEDS_CSUM;
+  chain.hdr.gso_type = virtio_net_hdr::VIRTIO_NET_HDR_GSO_TCPV4;
+  chain.hdr.hdr_len = first.hdr_len;
+  chain.hdr.gso_size = txq.gso_size;
+  chain.hdr.csum_start = csum.start;
+  chain.hdr.csum_offset = csum.offset;
+  segs[0] = { &chain.hdr, uint32_t(hdr_size_) };
+
+  for (const auto& frame : frames) {
+    pbuf_ref(frame.p);
+    chain.pbufs.push_back(frame.p);
+  }
+  send_queue.add_readable_segments(segs.data(), count, &chain);
+  return true;
+}
+
+// lwIP leaves TCP and UDP checksums to us. The device completes them from
+// the pseudo header sum if it can, otherwise they are computed here.
+void virtio_net_driver::prepare_tx_checksum(tx_frame& frame) {
+  l4_checksum csum;
+  if (!find_l4_checksum(static_cast<char*>(frame.payload),
+                        frame.len,
+                        frame.p->tot_len,
+                        csum))
+    return;
+
+  auto field = reinterpret_cast<uint16_t*>(static_cast<char*>(frame.payload) +
+                                           csum.start + csum.offset);
+  if (has_feature(VIRTIO_NET_F_CSUM)) {
+    *field = csum_fold(pseudo_header_sum(csum));
+    frame.csum_start = csum.start;
+    frame.csum_offset = csum.offset;
+    return;
+  }
+
+  ip_addr_t src, dest;
+  ip_addr_copy(src, csum.iph->src);
+  ip_addr_copy(dest, csum.iph->dest);
+  auto proto = IPH_PROTO(csum.iph);
+  *field = 0;
+  pbuf_header(frame.p, -static_cast<s16_t>(csum.start));
+  auto sum = inet_chksum_pseudo(frame.p, &src, &dest, proto, csum.len);
+  pbuf_header(frame.p, csum.start);
+  // a zero UDP checksum means there is none
+  if (sum == 0 && proto == IP_PROTO_UDP)
+    sum = 0xffff;
+  *field = sum;
+}
+
+// Gathers the buffers of a frame and hands it to lwIP once complete. A
+// frame spans num_buffers chains with mergeable receive buffers, otherwise
+// it is one chain.
+void virtio_net_driver::receive_chain(size_t pair, mutable_buffer_list list,
+                                      size_t len) {
+  auto& frame = rx_frames_[pair];
+  for (auto& buf : list) {
+    if (len == 0)
+      break;
+    // only the bytes the device wrote are passed on, the buffers it didn't
+    // touch return to the pool with list
+    auto n = std::min(buf.size(), len);
+    len -= n;
+    void* base;
+    size_t size;
+    std::tie(base, size) = buf.release();
+    mutable_buffer data(base, n);
+    if (frame.remaining == 0) {
+      kassert(n >= hdr_size_);
+      std::memcpy(&frame.hdr, base, hdr_size_);
+      frame.remaining = 1;
+      if (has_feature(VIRTIO_NET_F_MRG_RXBUF))
+        frame.remaining = std::max<uint16_t>(frame.hdr.num_buffers, 1);
+      frame.len = 0;
+      data += hdr_size_;
+    }
+    frame.len += data.size();
+    frame.bufs.push_front(std::move(data));
+  }
+  if (--frame.remaining > 0)
+    return;
 
-  auto& send_queue = get_queue(1);
-  kbugon(send_queue.get_num_free_descriptors() < bufs.size(),
-         "Must queue a packet, no more room\n");
+  mutable_buffer_list bufs;
+  bufs.swap(frame.bufs);
+  bufs.reverse();
+  // dropping the buffers returns them to the pool, a pbuf chain can't hold
+  // more than 64 KiB
+  if (frame.len + ETH_PAD_SIZE > std::numeric_limits<u16_t>::max() ||
+      !rx_checksum_ok(frame.hdr, bufs, frame.len))
+    return;
+  itf_->ReceivePacket(std::move(bufs));
+}
+
+// lwIP doesn't check TCP and UDP checksums, so a frame the device has not
+// vouched for is checked here
+bool virtio_net_driver::rx_checksum_ok(const virtio_net_hdr& hdr,
+                                       mutable_buffer_list& bufs,
+                                       size_t len) {
+  // a frame from this host may still only carry the pseudo header sum
+  if (hdr.flags & (virtio_net_hdr::VIRTIO_NET_HDR_F_DATA_VALID |
+                   virtio_net_hdr::VIRTIO_NET_HDR_F_NEEDS_CSUM))
+    return true;
+
+  auto& front = bufs.front();
+  auto frame = static_cast<char*>(front.addr());
+  l4_checksum csum;
+  if (!find_l4_checksum(frame, front.size(), len, csum))
+    return true;
 
-  send_queue.add_readable_buffer(std::move(bufs));
+  uint16_t field;
+  std::memcpy(&field, frame + csum.start + csum.offset, sizeof(field));
+  if (field == 0 && IPH_PROTO(csum.iph) == IP_PROTO_UDP)
+    return true;
+
+  // a buffer's part starting at an odd offset into the datagram adds in
+  // byte swapped
+  auto sum = pseudo_header_sum(csum);
+  size_t offset = csum.start;
+  size_t remaining = csum.len;
+  bool odd = false;
+  for (auto& buf : bufs) {
+    if (remaining == 0)
+      break;
+    auto n = std::min(buf.size() - offset, remaining);
+    uint16_t part =
+        ~inet_chksum(static_cast<char*>(buf.addr()) + offset, n);
+    if (odd)
+      part = part << 8 | part >> 8;
+    sum += part;
+    odd ^= n & 1;
+    remaining -= n;
+    offset = 0;
+  }
+  return csum_fold(sum) == 0xffff;
+}
+
+void virtio_net_driver::drain_tx_backlog(size_t pair) {
+  auto& txq = tx_queues_[pair];
+  if (txq.backlog.empty())
+    return;
+
+  auto& send_queue = get_queue(tx_queue_index(pair));
+  send_queue.hold_kicks();
+  while (!txq.backlog.empty() && add_tx_frame(pair, txq.backlog.front())) {
+    pbuf_free(txq.backlog.front().p);
+    txq.backlog.pop_front();
+  }
+  send_queue.release_kicks();
+
+  if (txq.stopped && txq.backlog.size() <= TX_BACKLOG_LOW)
+    txq.stopped = false;
+}
+
+// Batches nest, the held segments and the kick go out when the outermost
+// one ends
+void virtio_net_driver::begin_send_batch() {
+  auto pair = my_pair();
+  if (tx_queues_[pair].batch_depth++ == 0)
+    get_queue(tx_queue_index(pair)).hold_kicks();
+}
+
+void virtio_net_driver::end_send_batch() {
+  auto pair = my_pair();
+  auto& txq = tx_queues_[pair];
+  kassert(txq.batch_depth > 0);
+  if (--txq.batch_depth > 0)
+    return;
+
+  flush_gso(pair);
+  get_queue(tx_queue_index(pair)).release_kicks();
 }
 
 const std::array<char, 6> &virtio_net_driver::get_mac_address() { return mac_addr_; }
+
+uint16_t virtio_net_driver::get_mtu() { return mtu_; }
+
+uint16_t virtio_net_driver::get_max_mtu() { return max_mtu_; }
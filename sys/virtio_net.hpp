@@ -1,15 +1,42 @@
 #pragma once
 
+#include <array>
+#include <deque>
+#include <vector>
+
+#include <sys/dma_pool.hpp>
 #include <sys/net.hpp>
 #include <sys/virtio.hpp>
 
 namespace ebbrt {
 class virtio_net_driver : public virtio_driver<virtio_net_driver>,
                           public EthernetDevice {
-  void fill_rx_ring();
+  // Queue pair i is receive queue 2i and send queue 2i + 1. Its interrupts
+  // go to core i and cores beyond the number of pairs share them round
+  // robin.
+  size_t rx_queue_index(size_t pair) const { return pair * 2; }
+  size_t tx_queue_index(size_t pair) const { return pair * 2 + 1; }
+  size_t my_pair() const;
+
+  void setup_queue_pair(size_t pair);
+  void fill_rx_ring(size_t pair);
+  bool set_queue_pairs(size_t ctrl_index, uint16_t pairs);
+
+  // A frame waiting for room in the send ring. The head segment is recorded
+  // when queued because the caller moves the pbuf's header back afterwards.
+  struct tx_frame {
+    struct pbuf* p;
+    void* payload;
+    uint16_t len;
+    // where the device starts checksumming and where from there it stores
+    // the result, csum_start is 0 when it has nothing to do
+    uint16_t csum_start;
+    uint16_t csum_offset;
+  };
 
   struct virtio_net_hdr {
     static const constexpr uint8_t VIRTIO_NET_HDR_F_NEEDS_CSUM = 1;
+    static const constexpr uint8_t VIRTIO_NET_HDR_F_DATA_VALID = 2;
     uint8_t flags;
     static const constexpr uint8_t VIRTIO_NET_HDR_GSO_NONE = 0;
     static const constexpr uint8_t VIRTIO_NET_HDR_GSO_TCPV4 = 1;
@@ -23,17 +50,84 @@ class virtio_net_driver : public virtio_driver<virtio_net_driver>,
     uint16_t csum_offset;
     uint16_t num_buffers;
   };
+
+  // Ethernet header plus IP and TCP headers with the most options
+  static const constexpr size_t MAX_GSO_HDR_LEN = 14 + 60 + 60;
+
+  // The header and pbufs of a chain in the send ring, indexed by its head
+  // descriptor. A large frame's headers are built in gso_hdrs, lwIP may
+  // rewrite those of its own segment while the device reads them.
+  struct tx_chain {
+    virtio_net_hdr hdr;
+    std::array<char, MAX_GSO_HDR_LEN> gso_hdrs;
+    std::vector<struct pbuf*> pbufs;
+  };
+
+  struct tx_queue {
+    std::deque<tx_frame> backlog;
+    // set when the backlog reaches its high-water mark, frames other than TCP
+    // are refused until it drains to the low-water mark
+    bool stopped;
+    std::vector<tx_chain> chains;
+    // Within a send batch, consecutive segments of a TCP stream are held
+    // here and go out as one frame for the device to segment
+    std::vector<tx_frame> gso_frames;
+    uint32_t gso_next_seq;
+    uint16_t gso_size;
+    size_t gso_data_len;
+    // at most this many descriptors carry the held frames
+    size_t gso_descriptors;
+    size_t batch_depth;
+  };
+
+  // A frame the device may spread over several receive buffers, gathered
+  // across calls of the receive handler
+  struct rx_frame {
+    virtio_net_hdr hdr;
+    mutable_buffer_list bufs;
+    size_t len;
+    uint16_t remaining;
+  };
+
+  void queue_tx_frame(size_t pair, const tx_frame& frame);
+  bool add_tx_frame(size_t pair, const tx_frame& frame);
+  void drain_tx_backlog(size_t pair);
+  bool gso_append(size_t pair, const tx_frame& frame);
+  bool add_gso_frame(size_t pair);
+  void flush_gso(size_t pair);
+  void prepare_tx_checksum(tx_frame& frame);
+  void receive_chain(size_t pair, mutable_buffer_list list, size_t len);
+  bool rx_checksum_ok(const virtio_net_hdr& hdr, mutable_buffer_list& bufs,
+                      size_t len);
+
   virtio_net_hdr empty_header_;
+  // bytes of virtio_net_hdr in use, num_buffers depends on a feature
+  size_t hdr_size_;
+  // receive buffers per descriptor chain
+  size_t rx_chain_len_;
+  uint16_t mtu_;
+  uint16_t max_mtu_;
+  dma_pool rx_pool_;
   std::array<char, 6> mac_addr_;
   NetworkManager::Interface* itf_;
+  size_t num_pairs_;
+  std::vector<tx_queue> tx_queues_;
+  std::vector<rx_frame> rx_frames_;
 
  public:
   static const constexpr uint16_t DEVICE_ID = 0x1000;
 
   static uint32_t get_driver_features();
+  static uint32_t filter_features(uint32_t features);
+  static nid_t queue_node(size_t index);
 
   virtio_net_driver(pci_device& dev);
   void send(const_buffer_list list) override;
+  bool send_pbuf(struct pbuf* p) override;
+  void begin_send_batch() override;
+  void end_send_batch() override;
   const std::array<char, 6> &get_mac_address();
+  uint16_t get_mtu() override;
+  uint16_t get_max_mtu() override;
 };
 }
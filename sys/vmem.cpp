@@ -75,15 +75,41 @@ void ebbrt::map_memory(pfn_t vfn, pfn_t pfn, uint64_t length) {
                         std::atomic_thread_fence(std::memory_order_release);
                       },
                       [](pte & entry) {
-    auto page = page_allocator->Alloc();
+    // a zeroed page is already a table of clear entries
+    auto page = page_allocator->AllocZeroed();
     kbugon(page == 0);
     auto page_addr = pfn_to_addr(page);
-    new (reinterpret_cast<void *>(page_addr)) pte[512];
     entry.set_normal(page_addr);
     return true;
   });
 }
 
+// Clears any mappings of the range from this core's page tables, the caller
+// is responsible for invalidating the TLBs (see tlb_shootdown)
+void ebbrt::unmap_memory(pfn_t vfn, uint64_t length) {
+  auto pte_root = pte{read_cr3()};
+  auto vaddr = pfn_to_addr(vfn);
+  traverse_page_table(pte_root, vaddr, vaddr + length, 0, 4,
+                      [](pte & entry, uint64_t base_virt, size_t level) {
+                        entry.clear();
+                        std::atomic_thread_fence(std::memory_order_release);
+                      },
+                      [](pte & entry) { return false; });
+}
+
+// Only meaningful for regions mapped with 4KB pages (e.g. by map_memory)
+bool ebbrt::is_mapped(pfn_t vfn) {
+  auto pte_root = pte{read_cr3()};
+  auto vaddr = pfn_to_addr(vfn);
+  auto ret = false;
+  traverse_page_table(pte_root, vaddr, vaddr + PAGE_SIZE, 0, 4,
+                      [&](pte & entry, uint64_t base_virt, size_t level) {
+                        ret = entry.present();
+                      },
+                      [](pte & entry) { return false; });
+  return ret;
+}
+
 void ebbrt::enable_runtime_page_table() {
   asm volatile("mov %[page_table], %%cr3"
                :
@@ -99,5 +99,7 @@ void enable_runtime_page_table();
 void early_map_memory(uint64_t addr, uint64_t length);
 void early_unmap_memory(uint64_t addr, uint64_t length);
 void map_memory(pfn_t vfn, pfn_t pfn, uint64_t length = PAGE_SIZE);
+void unmap_memory(pfn_t vfn, uint64_t length = PAGE_SIZE);
+bool is_mapped(pfn_t vfn);
 void vmem_ap_init(size_t index);
 }
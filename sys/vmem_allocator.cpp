@@ -1,5 +1,7 @@
 #include <sys/cpu.hpp>
+#include <sys/event_manager.hpp>
 #include <sys/local_id_map.hpp>
+#include <sys/tlb.hpp>
 #include <sys/vmem_allocator.hpp>
 
 using namespace ebbrt;
@@ -21,47 +23,194 @@ VMemAllocator &VMemAllocator::HandleFault(EbbId id) {
   return ref;
 }
 
-VMemAllocator::VMemAllocator() {
-  regions_.emplace(std::piecewise_construct,
-                   std::forward_as_tuple(pfn_up(0xFFFF800000000000)),
-                   std::forward_as_tuple(pfn_down(LOCAL_TRANS_VMEM_START)));
+VMemAllocator::VMemAllocator() : generation_{ 0 } {
+  auto p = regions_.emplace(
+      std::piecewise_construct,
+      std::forward_as_tuple(pfn_up(0xFFFF800000000000)),
+      std::forward_as_tuple(pfn_down(LOCAL_TRANS_VMEM_START)));
+  free_regions_.emplace(region_npages(p.first), p.first->first);
 }
 
 pfn_t VMemAllocator::Alloc(size_t npages,
                            std::unique_ptr<page_fault_handler_t> pf_handler) {
+  {
+    auto &cache = caches_[my_cpu()];
+    std::lock_guard<spinlock> cache_lock{ cache.regions_lock };
+    auto &regions = cache.regions;
+    for (auto it = regions.rbegin(); it != regions.rend(); ++it) {
+      auto region_it = *it;
+      if (region_npages(region_it) != npages)
+        continue;
+
+      regions.erase(std::next(it).base());
+      if (pf_handler)
+        pf_handler->set_region(region_it->first, npages);
+      // A cached region stays allocated, so no other core will split or
+      // coalesce it and we can install the handler without the lock
+      region_it->second.page_fault_handler = std::move(pf_handler);
+      return region_it->first;
+    }
+  }
+
+  std::lock_guard<spinlock> lock{ lock_ };
+  auto fit = free_regions_.lower_bound(std::make_pair(npages, pfn_t(0)));
+  if (fit == free_regions_.end()) {
+    // the cached regions may coalesce into a fit
+    DrainRegionCaches();
+    fit = free_regions_.lower_bound(std::make_pair(npages, pfn_t(0)));
+  }
+  if (fit == free_regions_.end()) {
+    kabort("%s: unable to allocate %llu virtual pages\n", __PRETTY_FUNCTION__,
+           npages);
+  }
+
+  auto begin = fit->second;
+  free_regions_.erase(fit);
+  auto it = regions_.find(begin);
+  kassert(it != regions_.end() && !it->second.allocated);
+
+  auto &end = it->second.end;
+  auto ret = end - npages;
+  if (pf_handler)
+    pf_handler->set_region(ret, npages);
+
+  if (ret == begin) {
+    it->second.allocated = true;
+    it->second.page_fault_handler = std::move(pf_handler);
+  } else {
+    end -= npages;
+    free_regions_.emplace(region_npages(it), begin);
+    auto p =
+        regions_.emplace(std::piecewise_construct, std::forward_as_tuple(ret),
+                         std::forward_as_tuple(ret + npages));
+    p.first->second.allocated = true;
+    p.first->second.page_fault_handler = std::move(pf_handler);
+  }
+
+  return ret;
+}
+
+void VMemAllocator::Free(pfn_t vfn, size_t npages) {
+  std::shared_ptr<page_fault_handler_t> handler;
+  region_map::iterator it;
+  {
+    std::lock_guard<spinlock> lock{ lock_ };
+    it = regions_.find(vfn);
+    kbugon(it == regions_.end() || !it->second.allocated ||
+               region_npages(it) != npages,
+           "%s: no allocated region of %llu pages at %#018llx\n",
+           __PRETTY_FUNCTION__, npages, pfn_to_addr(vfn));
+    handler = std::move(it->second.page_fault_handler);
+    generation_.fetch_add(1, std::memory_order_release);
+  }
+
+  // Other cores may still hold the region in their TLBs. APs only copy the
+  // top level of the page tables, so a core can pick up a mapping another
+  // core's fault installed without faulting itself and every core has to
+  // drop it. Only then may the handler release its backing pages and the
+  // range be handed out again.
+  cpumask cores;
+  cores.set();
+  tlb_shootdown shootdown(true);
+  shootdown.add_range(vfn, npages);
+  shootdown.add_cores(cores);
+  auto cpu = my_cpu();
+  shootdown.flush([this, it, handler, cpu]() mutable {
+    handler.reset();
+    // done runs on whichever core finished last, the region belongs in the
+    // freeing core's cache, which only that core touches without lock_
+    event_manager->SpawnRemote([this, it]() { Release(it); }, cpu);
+  });
+}
+
+void VMemAllocator::Release(region_map::iterator it) {
   std::lock_guard<spinlock> lock{ lock_ };
-  for (auto it = regions_.begin(); it != regions_.end(); ++it) {
-    const auto &begin = it->first;
-    auto &end = it->second.end;
-    if (it->second.page_fault_handler || end - begin < npages)
-      continue;
-
-    auto ret = end - npages;
-
-    if (ret == begin) {
-      it->second.page_fault_handler = std::move(pf_handler);
-    } else {
-      end -= npages;
-      auto p =
-          regions_.emplace(std::piecewise_construct, std::forward_as_tuple(ret),
-                           std::forward_as_tuple(ret + npages));
-      p.first->second.page_fault_handler = std::move(pf_handler);
+  auto &cache = caches_[my_cpu()];
+  std::lock_guard<spinlock> cache_lock{ cache.regions_lock };
+  auto &regions = cache.regions;
+  if (regions.size() == regions.capacity()) {
+    // evict the least recently freed region to make room
+    FreeLocked(regions.front());
+    regions.erase(regions.begin());
+  }
+  regions.push_back(it);
+}
+
+// Called with lock_ held
+void VMemAllocator::DrainRegionCaches() {
+  for (auto &cache : caches_) {
+    std::lock_guard<spinlock> cache_lock{ cache.regions_lock };
+    for (auto it : cache.regions)
+      FreeLocked(it);
+    cache.regions.clear();
+  }
+}
+
+void VMemAllocator::FreeLocked(region_map::iterator it) {
+  it->second.allocated = false;
+  kassert(!it->second.page_fault_handler);
+
+  // regions_ is sorted in descending order, so the region above us in the
+  // address space precedes us in the map
+  if (it != regions_.begin()) {
+    auto above = std::prev(it);
+    if (!above->second.allocated && above->first == it->second.end) {
+      free_regions_.erase(std::make_pair(region_npages(above), above->first));
+      it->second.end = above->second.end;
+      regions_.erase(above);
     }
+  }
 
-    return ret;
+  auto below = std::next(it);
+  if (below != regions_.end() && !below->second.allocated &&
+      below->second.end == it->first) {
+    free_regions_.erase(std::make_pair(region_npages(below), below->first));
+    below->second.end = it->second.end;
+    regions_.erase(it);
+    it = below;
   }
-  kabort("%s: unable to allocate %llu virtual pages\n", __PRETTY_FUNCTION__,
-         npages);
+
+  free_regions_.emplace(region_npages(it), it->first);
 }
 
 void VMemAllocator::HandlePageFault(exception_frame *ef) {
-  std::lock_guard<spinlock> lock{ lock_ };
   auto fault_addr = read_cr2();
-  auto it = regions_.lower_bound(pfn_down(fault_addr));
-  kbugon(it == regions_.end() || it->second.end < pfn_up(fault_addr),
-         "Could not find region for faulting address!\n");
-  kbugon(!it->second.page_fault_handler, "Fault on a free region!\n");
-  it->second.page_fault_handler->handle_fault(ef, fault_addr);
+  auto vfn = pfn_down(fault_addr);
+  auto &cache = caches_[my_cpu()];
+
+  auto generation = generation_.load(std::memory_order_acquire);
+  if (cache.generation != generation) {
+    for (auto &entry : cache.faults)
+      entry.handler = nullptr;
+    cache.generation = generation;
+  }
+
+  // Handlers run without lock_ held so faults on different cores (and faults
+  // taken by a handler itself) proceed in parallel. A fault racing with Free
+  // of the same region is a bug in the caller.
+  for (const auto &entry : cache.faults) {
+    if (entry.handler != nullptr && entry.begin <= vfn && vfn < entry.end) {
+      entry.handler->handle_fault(ef, fault_addr);
+      return;
+    }
+  }
+
+  page_fault_handler_t *handler;
+  {
+    std::lock_guard<spinlock> lock{ lock_ };
+    auto it = regions_.lower_bound(vfn);
+    kbugon(it == regions_.end() || it->second.end <= vfn,
+           "Could not find region for faulting address!\n");
+    kbugon(!it->second.page_fault_handler, "Fault on a free region!\n");
+    handler = it->second.page_fault_handler.get();
+
+    auto &entry = cache.faults[cache.next_fault];
+    entry.begin = it->first;
+    entry.end = it->second.end;
+    entry.handler = handler;
+    cache.next_fault = (cache.next_fault + 1) % FAULT_CACHE_SIZE;
+  }
+  handler->handle_fault(ef, fault_addr);
 }
 
 extern "C" void page_fault_exception(exception_frame *ef) {
@@ -1,9 +1,15 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <map>
 #include <memory>
+#include <set>
+
+#include <boost/container/static_vector.hpp>
 
 #include <sys/cache_aligned.hpp>
+#include <sys/cpu.hpp>
 #include <sys/idt.hpp>
 #include <sys/pfn.hpp>
 #include <sys/spinlock.hpp>
@@ -12,8 +18,12 @@
 namespace ebbrt {
 class VMemAllocator : cache_aligned {
 public:
+  // handle_fault is called without any allocator lock held and may run
+  // concurrently on several cores for the same region
   class page_fault_handler_t {
   public:
+    // called once the region is allocated, before any fault on it
+    virtual void set_region(pfn_t start, size_t npages) {}
     virtual void handle_fault(exception_frame *, uintptr_t) = 0;
     virtual ~page_fault_handler_t() {}
   };
@@ -22,18 +32,62 @@ private:
 
   struct region {
     pfn_t end;
+    bool allocated;
     std::shared_ptr<page_fault_handler_t> page_fault_handler;
 
-    explicit region(pfn_t addr) : end{ addr } {}
-    bool free() { return static_cast<bool>(page_fault_handler); }
+    explicit region(pfn_t addr) : end{ addr }, allocated{ false } {}
+  };
+
+  typedef std::map<pfn_t, region, std::greater<pfn_t> > region_map;
+  // free regions ordered by (npages, start) so a best fit is a lower_bound
+  typedef std::set<std::pair<size_t, pfn_t> > free_region_set;
+
+  static const constexpr size_t REGION_CACHE_SIZE = 16;
+  static const constexpr size_t FAULT_CACHE_SIZE = 8;
+
+  struct fault_entry {
+    pfn_t begin;
+    pfn_t end;
+    page_fault_handler_t *handler;
+  };
+
+  struct region_cache : cache_aligned {
+    // Recently freed regions are kept allocated in regions_ and handed back
+    // out to exact size requests on the same core without taking lock_. Alloc
+    // drains every core's cache before giving up, so they are guarded by
+    // regions_lock, taken after lock_ when both are held.
+    spinlock regions_lock;
+    boost::container::static_vector<region_map::iterator, REGION_CACHE_SIZE>
+    regions;
+    // Regions this core recently faulted on, valid while generation matches
+    // the allocator's generation_
+    std::array<fault_entry, FAULT_CACHE_SIZE> faults;
+    size_t next_fault;
+    uint64_t generation;
+
+    region_cache() : next_fault{ 0 }, generation{ 0 } {
+      for (auto &entry : faults)
+        entry.handler = nullptr;
+    }
   };
 
   spinlock lock_;
-  std::map<pfn_t, region, std::greater<pfn_t> > regions_;
+  region_map regions_;
+  free_region_set free_regions_;
+  // bumped whenever a handler is removed, invalidates every fault cache
+  std::atomic<uint64_t> generation_;
+  std::array<region_cache, MAX_NUM_CPUS> caches_;
 
   VMemAllocator();
   friend void ::page_fault_exception(ebbrt::exception_frame *ef);
   void HandlePageFault(exception_frame *ef);
+  void Release(region_map::iterator it);
+  void FreeLocked(region_map::iterator it);
+  void DrainRegionCaches();
+
+  static size_t region_npages(region_map::const_iterator it) {
+    return it->second.end - it->first;
+  }
 
 public:
   static void Init();
@@ -41,6 +95,7 @@ public:
 
   pfn_t Alloc(size_t npages,
               std::unique_ptr<page_fault_handler_t> pf_handler = nullptr);
+  void Free(pfn_t vfn, size_t npages);
 };
 
 constexpr auto vmem_allocator = EbbRef<VMemAllocator>{ vmem_allocator_id };